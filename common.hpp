@@ -14,6 +14,7 @@
 #include <iomanip>
 #include <unordered_map>
 #include <unordered_set>
+#include <charconv>
 
 // #define NDEBUG
 #include <assert.h>
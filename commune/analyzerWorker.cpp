@@ -1,6 +1,7 @@
 #include "analyzerWorker.hpp"
 
 #include <boost/functional/hash.hpp>
+#include <sys/time.h>
 
 using namespace Whisper;
 
@@ -16,7 +17,17 @@ bool AnalyzerWorkerThread::run(){
     const size_t NUM_TRAIN_DATA = p_learner->p_learner_config->num_train_data;
 
     flow4_records = make_shared<std::vector<std::shared_ptr<flow_record_t>>>();
-    centers = torch::zeros({(long) p_learner->get_K(), (long) (p_analyzer_config->n_fft / 2) + 1});
+    flow6_records = make_shared<std::vector<std::shared_ptr<flow_record_t>>>();
+    scorer.reset(p_learner->get_K(), (p_analyzer_config->n_fft / 2) + 1, max_cluster_dist, 
+                 p_analyzer_config->single_precision);
+    m_centers_ready = false;
+    deferred.clear();
+    num_call = 0;
+    p_stft = stft_kernel::get(p_analyzer_config->n_fft, p_analyzer_config->single_precision);
+    with_flow_key([] (auto & ctx) -> void {
+        ctx.p_table4 = nullptr;
+        ctx.p_table6 = nullptr;
+    });
 
     auto& raw_data = *pkt_meta_ptr;
     size_t split_pos = std::max(
@@ -24,6 +35,10 @@ bool AnalyzerWorkerThread::run(){
         static_cast<size_t>(raw_data.size() * p_analyzer_config->train_ratio)
     );
 
+    if (p_analyzer_config->save_to_file) {
+        open_results();
+    }
+
     m_is_train = true;
     LOGF("AnalyzerWorkerThread: Start training phase...");
 
@@ -36,7 +51,7 @@ bool AnalyzerWorkerThread::run(){
                 wave_analyze(local_cache);
                 local_cache.clear();
             }
-            m_is_train = false;
+            leave_training();
             LOGF("AnalyzerWorkerThread: Start testing phase...");
         }
 
@@ -51,8 +66,111 @@ bool AnalyzerWorkerThread::run(){
         local_cache.clear();
     }
 
+    // A training still running scores the flows kept meanwhile and the ones left for the flush
+    await_centers();
+    if (p_analyzer_config->flow_continuation) {
+        flush_flows();
+        write_records();
+    }
+
     if (p_analyzer_config->save_to_file) {
-        save_res_json();
+        close_results();
+    }
+
+    return true;
+}
+
+
+bool AnalyzerWorkerThread::run_stream(const shared_ptr<packet_batch_pipe> p_pipe, const size_t num_pkt){
+    const size_t NUM_TRAIN_DATA = p_learner->p_learner_config->num_train_data;
+
+    flow4_records = make_shared<std::vector<std::shared_ptr<flow_record_t>>>();
+    flow6_records = make_shared<std::vector<std::shared_ptr<flow_record_t>>>();
+    scorer.reset(p_learner->get_K(), (p_analyzer_config->n_fft / 2) + 1, max_cluster_dist, 
+                 p_analyzer_config->single_precision);
+    m_centers_ready = false;
+    deferred.clear();
+    num_call = 0;
+    p_stft = stft_kernel::get(p_analyzer_config->n_fft, p_analyzer_config->single_precision);
+    with_flow_key([] (auto & ctx) -> void {
+        ctx.p_table4 = nullptr;
+        ctx.p_table6 = nullptr;
+    });
+
+    size_t split_pos = std::max(
+        NUM_TRAIN_DATA, 
+        static_cast<size_t>(num_pkt * p_analyzer_config->train_ratio)
+    );
+
+    if (p_analyzer_config->save_to_file) {
+        open_results();
+    }
+
+    m_is_train = true;
+    LOGF("AnalyzerWorkerThread: Start training phase...");
+
+    // Each batch is analyzed on its own. A batch is released once analyzed, so without
+    // flow_continuation every batch but the last must end on a chunk boundary, the chunks
+    // and their flows are then the same as in run(). Flows continue in the flow table otherwise.
+    shared_ptr<packet_batch> p_batch;
+    vector<size_t> local_cache;
+    while (p_pipe->pop(p_batch)) {
+        const size_t batch_end = p_batch->base_index + p_batch->size();
+        if (!p_analyzer_config->flow_continuation && batch_end < num_pkt && batch_end % NUM_TRAIN_DATA != 0) {
+            WARNF("Streaming batch ending at packet %ld cuts a chunk of %ld packets, "
+                  "stream whole chunks or turn flow_continuation on.", batch_end, NUM_TRAIN_DATA);
+            p_pipe->close();
+            p_pipe->release(move(p_batch));
+            if (p_analyzer_config->save_to_file) {
+                close_results();
+            }
+            return false;
+        }
+        pkt_meta_ptr = p_batch->p_pkts;
+        pkt_label_ptr = p_batch->p_labels;
+        pkt_index_base = p_batch->base_index;
+
+        for (size_t i = 0; i < p_batch->size(); ++i) {
+            const size_t idx = pkt_index_base + i;
+            local_cache.emplace_back(i);
+
+            if (m_is_train && idx >= split_pos) {
+                if (!local_cache.empty()) {
+                    wave_analyze(local_cache);
+                    local_cache.clear();
+                }
+                leave_training();
+                LOGF("AnalyzerWorkerThread: Start testing phase...");
+            }
+
+            if ((idx + 1) % NUM_TRAIN_DATA == 0) {
+                wave_analyze(local_cache);
+                local_cache.clear();
+            }
+        }
+
+        if (!local_cache.empty()) {
+            wave_analyze(local_cache);
+            local_cache.clear();
+        }
+
+        // The parser refills the batch, nothing may keep pointing into it
+        pkt_meta_ptr = nullptr;
+        pkt_label_ptr = nullptr;
+        p_pipe->release(move(p_batch));
+    }
+    p_pipe->close();
+    pkt_index_base = 0;
+
+    // A training still running scores the flows kept meanwhile and the ones left for the flush
+    await_centers();
+    if (p_analyzer_config->flow_continuation) {
+        flush_flows();
+        write_records();
+    }
+
+    if (p_analyzer_config->save_to_file) {
+        close_results();
     }
 
     return true;
@@ -60,218 +178,999 @@ bool AnalyzerWorkerThread::run(){
 
 
 void AnalyzerWorkerThread::wave_analyze(vector<size_t> data){   
-    vector<shared_ptr<basic_packet>> raw_data;
-    raw_data.reserve(data.size());
-    for(auto idx : data){
-        raw_data.emplace_back(pkt_meta_ptr->at(idx));
+    with_flow_key([&] (auto & ctx) -> void {
+        group_flows(data, ctx);
+        if (p_analyzer_config->flow_continuation) {
+            continue_flows(data, ctx);
+        } else {
+            analyze_flows(data, ctx);
+        }
+    });
+    write_records();
+}
+
+
+// Runs __fn on the containers of the configured flow key policy
+template<typename F>
+void AnalyzerWorkerThread::with_flow_key(F && __fn) 
+{
+    switch (p_analyzer_config->flow_key) {
+    case FLOW_KEY_ADDR_PAIR:
+        __fn(get<flow_key_ctx<addr_pair_key> >(key_ctxs));
+        break;
+    case FLOW_KEY_TUPLE4:
+        __fn(get<flow_key_ctx<tuple4_key> >(key_ctxs));
+        break;
+    default:
+        __fn(get<flow_key_ctx<src_addr_key> >(key_ctxs));
+        break;
     }
+}
 
-    const auto cur_len = raw_data.size();
-    static const double_t min_interval_time = 1e-5;
 
-    unordered_map<uint32_t, vector<size_t> > mp;
+template<typename P>
+void AnalyzerWorkerThread::group_flows(const vector<size_t> & data, flow_key_ctx<P> & ctx) 
+{
+    auto & store = *pkt_meta_ptr;
+    // An IPv4 source address is its own id, any other key is numbered first
+    constexpr bool direct4 = is_same<typename P::key4_t, pkt_addr4_t>::value;
+
+    const auto cur_len = data.size();
+
+    // One index array sorted by key, instead of a growing vector per key
+    groups4.clear();
+    pos4.clear();
+    pos6.clear();
     for (size_t i = 0; i < cur_len; i++) {
-        auto pkt = raw_data[i];
-        if (typeid(*pkt) != typeid(basic_packet4)) continue;
-        const auto _p_rep = dynamic_pointer_cast<basic_packet4>(pkt);
-        uint32_t addr = (ntohl(tuple_get_src_addr(_p_rep->flow_id)));
-        analysis_pkt_len += _p_rep->len;
-        if(mp.find(addr) == mp.end()){
-            mp.insert(pair<uint32_t, vector<size_t> >(addr, vector<size_t>()));
-        }
-        mp[addr].push_back(i);
-    }
-
-    decltype(mp)::const_iterator iter_mp;
-    for (iter_mp = mp.cbegin(); iter_mp != mp.cend(); iter_mp++) {
-        const auto & _ve = iter_mp->second;
-        if(_ve.size() < 2 * p_analyzer_config->n_fft) continue;
-
-        for (size_t i = _ve.size() - 1; i > 0; i --) {
-            raw_data[_ve[i]]->ts -= raw_data[_ve[i - 1]]->ts;
-            if (raw_data[_ve[i]]->ts <= 0) {
-                raw_data[_ve[i]]->ts = min_interval_time;
+        const size_t idx = data[i];
+        if (store.is_ipv4(idx)) {
+            analysis_pkt_len += store.len[idx];
+            if constexpr (direct4) {
+                groups4.add(src_addr_key::key4(store, idx), i);
+            } else {
+                pos4.push_back(i);
             }
+        } else if (store.is_ipv6(idx)) {
+            pos6.push_back(i);
         }
-        raw_data[_ve[0]]->ts = min_interval_time;
-
-        torch::Tensor ten = torch::zeros(_ve.size());
-        for (int i = 0; i < _ve.size(); i++) {
-            ten[i] = weight_transform(raw_data[_ve[i]]);
-        }
-
-        torch::Tensor window = torch::hann_window(p_analyzer_config->n_fft);
-        torch::Tensor ten_fft = torch::stft(
-            ten,
-            p_analyzer_config->n_fft,
-            c10::nullopt,      // hop_length
-            c10::nullopt,      // win_length
-            window,            // window
-            true,              // center
-            "reflect",         // pad_mode
-            false,             // normalized
-            true,              // onesided
-            true               // return_complex
-        );        
-
-        torch::Tensor ten_power = ten_fft.abs().pow(2);
-        ten_power = ten_power.squeeze();
-
-        torch::Tensor ten_res = ((ten_power + 1).log2()).permute({1, 0});
-        ten_res = torch::where(torch::isnan(ten_res), torch::full_like(ten_res, 0), ten_res);
-        ten_res = torch::where(torch::isinf(ten_res), torch::full_like(ten_res, 0), ten_res);
-
-        if (m_is_train) {
-            torch::Tensor ten_temp;
-            if (ten_res.size(0) > p_analyzer_config->mean_win_train + 1 && !p_learner->reach_learn()) {
-                vector<vector<double_t> > data_to_add;
-                for (size_t i = 0; i < p_analyzer_config->num_train_sample; i ++) {
-                    size_t start_index = rand() % (ten_res.size(0) - 1 - p_analyzer_config->mean_win_train);
-                    ten_temp = ten_res.slice(0, start_index, start_index + p_analyzer_config->mean_win_train).mean(0);
-                    vector<double_t> _dt;
-                    for(size_t j = 0; j < ten_temp.size(0); j ++) {
-                        _dt.push_back((double_t) ten_temp[j].item<double_t>());
-                    }
-                    data_to_add.push_back(_dt);
-                }
-                p_learner->add_train_data(data_to_add);
+    }
+    if (!pos4.empty()) {
+        ctx.ids4.reset(pos4.size());
+        for (auto i : pos4) {
+            groups4.add(ctx.ids4.get_id(P::key4(store, data[i])), i);
+        }
+    }
+    groups4.group();
+
+    // IPv6 keys get dense ids in first-seen order, then group the same way
+    groups6.clear();
+    if (!pos6.empty()) {
+        ctx.ids6.reset(pos6.size());
+        for (auto i : pos6) {
+            const size_t idx = data[i];
+            analysis_pkt_len += store.len[idx];
+            groups6.add(ctx.ids6.get_id(P::key6(store, idx)), i);
+        }
+    }
+    groups6.group();
+}
+
+
+template<typename P>
+void AnalyzerWorkerThread::analyze_flows(const vector<size_t> & data, flow_key_ctx<P> & ctx) 
+{
+    constexpr bool direct4 = is_same<typename P::key4_t, pkt_addr4_t>::value;
+
+    // Flows long enough for the transform, IPv4 ones in key order then IPv6 ones,
+    // numbered after the IPv4 groups
+    const size_t num_group4 = groups4.num_flow();
+    vector<size_t> flows;
+    for (size_t k = 0; k < num_group4; k++) {
+        if (groups4.flow(k).size() >= 2 * p_analyzer_config->n_fft) {
+            flows.push_back(k);
+        }
+    }
+    for (size_t k = 0; k < groups6.num_flow(); k++) {
+        if (groups6.flow(k).size() >= 2 * p_analyzer_config->n_fft) {
+            flows.push_back(num_group4 + k);
+        }
+    }
+    const size_t num_flow = flows.size();
+
+    poll_centers();
+    const size_t call = num_call ++;
+
+    const auto __range = [&] (size_t g) -> index_range {
+        return g < num_group4 ? groups4.flow(g) : groups6.flow(g - num_group4);
+    };
+    const auto __record = [&] (size_t g, const pair<double_t, int> & score) -> shared_ptr<flow_record_t> {
+        auto rec = make_record(data, __range(g), score);
+        if (rec == nullptr) {
+            return rec;
+        }
+        if (g >= num_group4) {
+            label_record(*rec, ctx.ids6.get_key(groups6.key(g - num_group4)), true);
+        } else if constexpr (direct4) {
+            label_record(*rec, groups4.key(g), false);
+        } else {
+            label_record(*rec, ctx.ids4.get_key(groups4.key(g)), false);
+        }
+        return rec;
+    };
+
+    const bool parallel = p_analyzer_config->parallel_flow && 
+        p_worker_pool != nullptr && p_worker_pool->size() > 1;
+    const size_t block_size = parallel ? p_worker_pool->size() * 4 : 1;
+    if (flow_buffers.size() < block_size) {
+        flow_buffers.resize(block_size);
+    }
+
+    // Results land in flow order whatever thread produced them
+    vector<shared_ptr<flow_record_t> > records(num_flow);
+
+    // Records of flows[_from, _to) from their windows, kept unscored while the learner trains
+    const auto __finish = [&] (size_t _from, size_t _to, window_batch & batch, 
+                               vector<pair<double_t, int> > & scores) -> void {
+        if (!m_centers_ready) {
+            deferred_part_t part{call, _from, move(batch), {}, {}};
+            for (size_t k = _from; k < _to; ++ k) {
+                part.records.push_back(__record(flows[k], {max_cluster_dist, -1}));
+            }
+            defer_part(move(part));
+            return;
+        }
+        scorer.score(batch, scores);
+        for (size_t k = _from; k < _to; ++ k) {
+            records[k] = __record(flows[k], scores[k - _from]);
+        }
+    };
+
+    // Training feeds the learner in flow order, and the learner may switch to testing
+    // at any flow, so only the transforms of a block run concurrently
+    size_t pos = 0;
+    while (pos < num_flow && m_is_train) {
+        const size_t block_end = min(pos + block_size, num_flow);
+        const auto __transform = [&] (size_t k) -> void {
+            transform_flow(data, __range(flows[k]), flow_buffers[k - pos]);
+        };
+        if (parallel) {
+            p_worker_pool->parallel_for_each(pos, block_end, __transform, block_end - pos);
+        } else {
+            for (size_t k = pos; k < block_end; ++ k) __transform(k);
+        }
+
+        size_t k = pos;
+        for (; k < block_end && m_is_train; ++ k) {
+            train_flow(flow_buffers[k - pos].spec);
+        }
+        // Rest of the block after the learner started
+        if (k < block_end) {
+            auto & batch = flow_buffers[0].windows;
+            batch.reset(scorer.get_dim(), scorer.is_single());
+            for (size_t f = k; f < block_end; ++ f) {
+                collect_windows(flow_buffers[f - pos].spec, batch);
+            }
+            __finish(k, block_end, batch, flow_buffers[0].scores);
+        }
+        pos = block_end;
+    }
+
+    // Testing flows are independent, the windows of a whole part are scored at once
+    const auto __test = [&] (size_t _from, size_t _to, flow_buffer_t & buf) -> void {
+        buf.windows.reset(scorer.get_dim(), scorer.is_single());
+        for (size_t k = _from; k < _to; ++ k) {
+            transform_flow(data, __range(flows[k]), buf);
+            collect_windows(buf.spec, buf.windows);
+        }
+        __finish(_from, _to, buf.windows, buf.scores);
+    };
+    if (parallel) {
+        p_worker_pool->parallel_for(pos, num_flow, [&] (size_t _from, size_t _to) -> void {
+            flow_buffer_t buf;
+            __test(_from, _to, buf);
+        });
+    } else {
+        __test(pos, num_flow, flow_buffers[0]);
+    }
+
+    for (auto & rec : records) {
+        if (rec != nullptr) {
+            (rec->is_ipv6 ? flow6_records : flow4_records)->push_back(rec);
+        }
+    }
+}
+
+
+template<typename P>
+void AnalyzerWorkerThread::continue_flows(const vector<size_t> & data, flow_key_ctx<P> & ctx) 
+{
+    constexpr bool direct4 = is_same<typename P::key4_t, pkt_addr4_t>::value;
+
+    if (groups4.num_flow() > 0) {
+        continue_family(data, groups4, ctx.p_table4, false, [&] (size_t k) -> typename P::key4_t {
+            if constexpr (direct4) {
+                return groups4.key(k);
             } else {
-                ten_temp =  ten_res.mean(0);
-                vector<double_t> data_to_add;
-                for(size_t j = 0; j < ten_temp.size(0); j ++) {
-                    data_to_add.push_back((double_t) ten_temp[j].item<double_t>());
+                return ctx.ids4.get_key(groups4.key(k));
+            }
+        });
+    }
+    if (groups6.num_flow() > 0) {
+        continue_family(data, groups6, ctx.p_table6, true, [&] (size_t k) -> typename P::key6_t {
+            return ctx.ids6.get_key(groups6.key(k));
+        });
+    }
+
+    if (data.empty()) {
+        return;
+    }
+    // The states of this chunk are accounted and may go again
+    if (ctx.p_table4 != nullptr) {
+        ctx.p_table4->unpin_all();
+    }
+    if (ctx.p_table6 != nullptr) {
+        ctx.p_table6->unpin_all();
+    }
+    // Both tables share the memory budget
+    const double_t now = pkt_meta_ptr->ts[data.back()];
+    const size_t budget = p_analyzer_config->max_table_mb << 20;
+    const auto __rest = [&] (const auto & p_other) -> size_t {
+        const size_t used = p_other == nullptr ? 0 : p_other->memory_bytes();
+        return budget - min(budget, used);
+    };
+    if (ctx.p_table4 != nullptr) {
+        expire_family(*ctx.p_table4, false, now, __rest(ctx.p_table6));
+    }
+    if (ctx.p_table6 != nullptr) {
+        expire_family(*ctx.p_table6, true, now, __rest(ctx.p_table4));
+    }
+}
+
+
+template<typename K, typename F>
+void AnalyzerWorkerThread::continue_family(const vector<size_t> & data, const flow_groups & groups, 
+                                           shared_ptr<flow_table<flow_state, K> > & p_table, 
+                                           const bool is_ipv6, F && key_of) 
+{
+    // Built on the first flow of its kind, an IPv4-only trace never pays for the IPv6 table
+    if (p_table == nullptr) {
+        p_table = make_shared<flow_table<flow_state, K> >(p_analyzer_config->max_flows);
+        if (p_table->fixed_bytes() > (p_analyzer_config->max_table_mb << 20)) {
+            WARNF("Flow table of %ld flows takes %ld MB alone, above max_table_mb, no flow outlives its chunk.", 
+                p_table->capacity(), p_table->fixed_bytes() >> 20);
+        }
+    }
+
+    // Flows displaced by new keys, and new keys the table had no room for,
+    // which are analyzed as flows of this chunk alone
+    vector<K> evicted_keys, overflow_keys;
+    deque<flow_state> evicted, overflow;
+    const auto __evict = [&] (const K & key, flow_state & st) -> void {
+        evicted_keys.push_back(key);
+        evicted.push_back(move(st));
+    };
+
+    // States are looked up serially, table values do not move and stay pinned for the chunk
+    vector<K> keys;
+    vector<index_range> ve_list;
+    vector<flow_state *> states;
+    for (size_t k = 0; k < groups.num_flow(); k++) {
+        const K key = key_of(k);
+        flow_state * p_state = p_table->insert(key, __evict);
+        if (p_state == nullptr) {
+            overflow_keys.push_back(key);
+            overflow.emplace_back();
+            p_state = &overflow.back();
+        }
+        keys.push_back(key);
+        ve_list.push_back(groups.flow(k));
+        states.push_back(p_state);
+    }
+
+    flush_states(evicted_keys, is_ipv6, evicted);
+    advance_flows(&data, [&] (const size_t k, flow_record_t & rec) -> void {
+        label_record(rec, keys[k], is_ipv6);
+    }, ve_list, states, false);
+    flush_states(overflow_keys, is_ipv6, overflow);
+}
+
+
+// Flows past their timeout on the way of the expiry hand, then the least recently seen
+// ones while the table is over max_bytes, are scored and forgotten
+template<typename K>
+void AnalyzerWorkerThread::expire_family(flow_table<flow_state, K> & table, const bool is_ipv6, 
+                                         const double_t now, const size_t max_bytes) 
+{
+    const double_t idle_timeout = p_analyzer_config->idle_timeout;
+    const double_t active_timeout = p_analyzer_config->active_timeout;
+
+    vector<K> expired_keys;
+    deque<flow_state> expired;
+    const auto __expire = [&] (const K & key, flow_state & st) -> void {
+        expired_keys.push_back(key);
+        expired.push_back(move(st));
+    };
+    if (idle_timeout > 0 || active_timeout > 0) {
+        table.expire(
+            [&] (const flow_state & st) -> bool {
+                return (idle_timeout > 0 && now - st.last_ts > idle_timeout) || 
+                    (active_timeout > 0 && now - st.first_ts > active_timeout);
+            }, 
+            __expire, (table.capacity() + expire_chunks - 1) / expire_chunks
+        );
+    }
+    table.trim(max_bytes, __expire);
+    flush_states(expired_keys, is_ipv6, expired);
+}
+
+
+void AnalyzerWorkerThread::flush_flows() 
+{
+    with_flow_key([&] (auto & ctx) -> void {
+        flush_family(ctx.p_table4, false);
+        flush_family(ctx.p_table6, true);
+    });
+}
+
+
+template<typename K>
+void AnalyzerWorkerThread::flush_family(shared_ptr<flow_table<flow_state, K> > & p_table, const bool is_ipv6) 
+{
+    if (p_table == nullptr) {
+        return;
+    }
+    auto & table = *p_table;
+    // Footprint as of the last chunk, before the flush releases the samples
+    const size_t table_bytes = table.memory_bytes();
+
+    vector<K> keys;
+    vector<flow_state *> states;
+    table.for_each([&] (const K & key, flow_state & st) -> void {
+        keys.push_back(key);
+        states.push_back(&st);
+    });
+    advance_flows(nullptr, [&] (const size_t k, flow_record_t & rec) -> void {
+        label_record(rec, keys[k], is_ipv6);
+    }, {}, states, true);
+
+    const auto & stat = table.get_counters();
+    LOGF("AnalyzerWorkerThread: IPv%d flow table of %ld flows (%ld MB), %ld inserted, %ld evicted, %ld expired, %ld trimmed, %ld overflowed.", 
+        is_ipv6 ? 6 : 4, table.capacity(), table_bytes >> 20, 
+        stat.inserted, stat.evicted, stat.expired, stat.trimmed, stat.overflowed);
+    p_table = nullptr;
+}
+
+
+template<typename K>
+void AnalyzerWorkerThread::flush_states(const vector<K> & keys, const bool is_ipv6, deque<flow_state> & states) 
+{
+    if (states.empty()) {
+        return;
+    }
+    vector<flow_state *> p_states;
+    for (auto & st : states) {
+        p_states.push_back(&st);
+    }
+    advance_flows(nullptr, [&] (const size_t k, flow_record_t & rec) -> void {
+        label_record(rec, keys[k], is_ipv6);
+    }, {}, p_states, true);
+}
+
+
+void AnalyzerWorkerThread::advance_flows(const vector<size_t> * data, const record_labeler_t & __label, 
+                                         const vector<index_range> & ve_list, 
+                                         const vector<flow_state *> & states, const bool flush) 
+{
+    const size_t num_flow = states.size();
+
+    poll_centers();
+    const size_t call = num_call ++;
+
+    const bool parallel = p_analyzer_config->parallel_flow && 
+        p_worker_pool != nullptr && p_worker_pool->size() > 1;
+    const size_t block_size = parallel ? p_worker_pool->size() * 4 : 1;
+    if (flow_buffers.size() < block_size) {
+        flow_buffers.resize(block_size);
+    }
+
+    // New frames of flow k, from its new packets or from the end of the trace
+    const auto __extend = [&] (size_t k, flow_buffer_t & buf) -> void {
+        if (flush) {
+            finish_flow(*states[k], buf);
+        } else {
+            extend_flow(*states[k], *data, ve_list[k], buf);
+        }
+    };
+    // Windows completed by the new frames are scored together, owner maps them back
+    const auto __test = [&] (size_t k, const spectrogram & spec, window_batch & batch, vector<size_t> & owner) -> void {
+        if (!flush) {
+            record_packets(*states[k], *data, ve_list[k]);
+        } else if (!states[k]->tested) {
+            // The tail of a flow trained on to the end stays out of the test
+            return;
+        }
+        push_test_frames(*states[k], spec, batch, owner, k);
+    };
+    // Kept while the learner trains, each window adding to the late score of its state
+    const auto __score = [&] (size_t _from, window_batch & batch, const vector<size_t> & owner, 
+                              vector<pair<double_t, int> > & scores) -> void {
+        if (!m_centers_ready) {
+            if (owner.empty()) {
+                return;
+            }
+            deferred_part_t part{call, _from, move(batch), {}, {}};
+            for (auto k : owner) {
+                auto & st = *states[k];
+                if (st.p_late == nullptr) {
+                    st.p_late = make_shared<pair<double_t, int> >(st.score);
                 }
-                p_learner->add_train_data(data_to_add);
+                part.owners.push_back(st.p_late);
+            }
+            defer_part(move(part));
+            return;
+        }
+        scorer.score(batch, scores);
+        for (size_t w = 0; w < owner.size(); ++ w) {
+            auto & st = *states[owner[w]];
+            if (scores[w].first > st.score.first) {
+                st.score = scores[w];
             }
+        }
+    };
 
-            if (p_learner->reach_learn() && !p_learner->start_learn) {
-                if (p_analyzer_config->mode_verbose) LOGF("Analyer: trigger the training of learner.");
-                p_learner->start_train();
+    size_t pos = 0;
+    while (pos < num_flow && m_is_train) {
+        const size_t block_end = min(pos + block_size, num_flow);
+        const auto __block = [&] (size_t k) -> void {
+            __extend(k, flow_buffers[k - pos]);
+        };
+        if (parallel) {
+            p_worker_pool->parallel_for_each(pos, block_end, __block, block_end - pos);
+        } else {
+            for (size_t k = pos; k < block_end; ++ k) __block(k);
+        }
+
+        size_t k = pos;
+        for (; k < block_end && m_is_train; ++ k) {
+            if (flow_buffers[k - pos].spec.num_frame > 0) {
+                train_flow(flow_buffers[k - pos].spec);
             }
+        }
+        if (k < block_end) {
+            auto & buf = flow_buffers[0];
+            buf.windows.reset(scorer.get_dim(), scorer.is_single());
+            buf.owner.clear();
+            for (size_t f = k; f < block_end; ++ f) {
+                __test(f, flow_buffers[f - pos].spec, buf.windows, buf.owner);
+            }
+            __score(k, buf.windows, buf.owner, buf.scores);
+        }
+        pos = block_end;
+    }
 
-            if (p_learner->finish_learn) {
-                analysis_start_time = __get_double_ts();
+    const auto __part = [&] (size_t _from, size_t _to, flow_buffer_t & buf) -> void {
+        buf.windows.reset(scorer.get_dim(), scorer.is_single());
+        buf.owner.clear();
+        for (size_t k = _from; k < _to; ++ k) {
+            __extend(k, buf);
+            __test(k, buf.spec, buf.windows, buf.owner);
+        }
+        __score(_from, buf.windows, buf.owner, buf.scores);
+    };
+    if (parallel) {
+        p_worker_pool->parallel_for(pos, num_flow, [&] (size_t _from, size_t _to) -> void {
+            flow_buffer_t buf;
+            __part(_from, _to, buf);
+        });
+    } else {
+        __part(pos, num_flow, flow_buffers[0]);
+    }
 
-                analysis_pkt_len = 0;
-                analysis_pkt_num = 0;
+    // Records of the states due, the ones with windows still kept wait for their late
+    // score in a part of their own, after the windows of this call
+    deferred_part_t late{call, SIZE_MAX, {}, {}, {}};
+    const auto __emit = [&] (size_t k) -> void {
+        auto & st = *states[k];
+        settle_score(st);
+        const auto rec = make_record(st);
+        if (rec == nullptr) {
+            return;
+        }
+        __label(k, *rec);
+        if (st.p_late != nullptr) {
+            late.records.push_back(rec);
+            late.owners.push_back(st.p_late);
+        } else {
+            (rec->is_ipv6 ? flow6_records : flow4_records)->push_back(rec);
+        }
+    };
+    const auto __keep_late = [&] () -> void {
+        if (!late.records.empty()) {
+            defer_part(move(late));
+        }
+    };
 
-                const auto & train_res = p_learner->train_result;
-                for (size_t i = 0; i < train_res.size(); i ++) {
-                    for (size_t j = 0; j < train_res[0].size(); j ++) {
-                        centers[i][j] = train_res[i][j];
-                    }
-                }
+    if (!flush) {
+        // Long flows hand their packets over in parts, each with the score so far
+        for (size_t k = 0; k < num_flow; ++ k) {
+            auto & st = *states[k];
+            if (st.pkt_indices.size() < p_analyzer_config->max_flow_packets) {
+                continue;
+            }
+            __emit(k);
+            st.split = true;
+        }
+        __keep_late();
+        return;
+    }
 
-                if(p_analyzer_config->mode_verbose) LOGF("Analyer: enter execution mode.");
-                m_is_train = false;
+    // Flows with no confirmed window are scored on the mean of all their test frames,
+    // so none of their windows was kept
+    auto & buf = flow_buffers[0];
+    buf.windows.reset(scorer.get_dim(), scorer.is_single());
+    buf.owner.clear();
+    vector<double_t> mean;
+    for (size_t k = 0; k < num_flow; ++ k) {
+        auto & st = *states[k];
+        if (st.test_frame == 0 || st.test_frame > p_analyzer_config->mean_win_test) {
+            continue;
+        }
+        buf.windows.open_flow(false);
+        mean.resize(st.total_sum.size());
+        for (size_t d = 0; d < st.total_sum.size(); ++ d) {
+            mean[d] = st.total_sum[d] / st.test_frame;
+        }
+        buf.windows.add_window(mean.data());
+        buf.owner.push_back(k);
+    }
+    if (!m_centers_ready) {
+        // The mean replaces the score, a negative distance lets any window take it
+        deferred_part_t part{call, num_flow, move(buf.windows), {}, {}};
+        for (auto k : buf.owner) {
+            auto & st = *states[k];
+            st.score = {-1, -1};
+            st.p_late = make_shared<pair<double_t, int> >(st.score);
+            part.owners.push_back(st.p_late);
+        }
+        if (!part.owners.empty()) {
+            defer_part(move(part));
+        }
+    } else {
+        scorer.score(buf.windows, buf.scores);
+        for (size_t w = 0; w < buf.owner.size(); ++ w) {
+            states[buf.owner[w]]->score = buf.scores[w];
+        }
+    }
+
+    for (size_t k = 0; k < num_flow; ++ k) {
+        if (states[k]->test_frame == 0 || (states[k]->split && states[k]->pkt_indices.empty())) {
+            continue;
+        }
+        __emit(k);
+    }
+    __keep_late();
+}
+
+
+void AnalyzerWorkerThread::extend_flow(flow_state & st, const vector<size_t> & data, 
+                                       const index_range & _ve, flow_buffer_t & buf) const 
+{
+    const auto & store = *pkt_meta_ptr;
+    static const double_t min_interval_time = 1e-5;
+
+    // The new weights go at the end of the samples, the interval part over all of them at once
+    const size_t num_pkt = _ve.size();
+    const size_t base = st.samples.size();
+    st.samples.resize(base + num_pkt);
+    buf.interval.resize(num_pkt);
+    for (size_t i = 0; i < num_pkt; i++) {
+        const size_t idx = data[_ve[i]];
+        double_t interval = min_interval_time;
+        if (st.num_pkt > 0 && store.ts[idx] - st.last_ts > 0) {
+            interval = store.ts[idx] - st.last_ts;
+        }
+        if (st.num_pkt == 0) {
+            st.first_ts = store.ts[idx];
+        }
+        st.last_ts = store.ts[idx];
+        ++ st.num_pkt;
+        buf.interval[i] = interval;
+        st.samples[base + i] = weight_kernel::packet_part(store.tp[idx], store.len[idx]);
+    }
+    weight_kernel::add_interval_part(buf.interval.data(), num_pkt, st.samples.data() + base);
+
+    buf.spec.num_frame = 0;
+    if (!st.started) {
+        // Short flows wait for more packets, as a whole-flow transform would skip them
+        if (st.samples.size() < 2 * p_analyzer_config->n_fft) {
+            return;
+        }
+        const size_t pad = p_stft->get_pad();
+        vector<double_t> head(pad);
+        for (size_t j = 0; j < pad; ++ j) {
+            head[pad - 1 - j] = st.samples[j + 1];
+        }
+        st.samples.insert(st.samples.begin(), head.begin(), head.end());
+        st.started = true;
+    }
+    cut_frames(st, buf);
+}
+
+
+void AnalyzerWorkerThread::finish_flow(flow_state & st, flow_buffer_t & buf) const 
+{
+    buf.spec.num_frame = 0;
+    if (!st.started) {
+        return;
+    }
+    // Right reflect padding from the last samples, which no frame has consumed yet
+    const size_t pad = p_stft->get_pad();
+    const size_t len = st.samples.size();
+    assert(len >= st.head + pad + 1);
+    for (size_t j = 0; j < pad; ++ j) {
+        st.samples.push_back(st.samples[len - 2 - j]);
+    }
+    cut_frames(st, buf);
+    st.samples.clear();
+    st.samples.shrink_to_fit();
+    st.head = 0;
+}
+
+
+void AnalyzerWorkerThread::cut_frames(flow_state & st, flow_buffer_t & buf) const 
+{
+    const size_t num_frame = p_stft->transform_padded(st.samples.data() + st.head, 
+                                                      st.samples.size() - st.head, buf.spec);
+    st.head += num_frame * p_stft->get_hop();
+    if (st.head > st.samples.size() / 2) {
+        st.samples.erase(st.samples.begin(), st.samples.begin() + st.head);
+        st.head = 0;
+    }
+    buf.spec.build_prefix();
+}
+
+
+void AnalyzerWorkerThread::record_packets(flow_state & st, const vector<size_t> & data, 
+                                          const index_range & _ve) const 
+{
+    for (auto id : _ve) {
+        const size_t idx = data[id];
+        st.tested = true;
+        if (p_analyzer_config->save_to_file) {
+            st.pkt_indices.push_back(idx + pkt_index_base);
+        }
+        st.is_malicious |= pkt_label_ptr->at(idx) == 1;
+    }
+}
+
+
+void AnalyzerWorkerThread::push_test_frames(flow_state & st, const spectrogram & spec, 
+                                            window_batch & batch, vector<size_t> & owner, const size_t k) const 
+{
+    const size_t win = p_analyzer_config->mean_win_test;
+    const size_t dim = spec.num_bin;
+    if (st.total_sum.empty()) {
+        st.win_sum.assign(dim, 0);
+        st.total_sum.assign(dim, 0);
+        st.pending.assign(dim, 0);
+    }
+
+    for (size_t f = 0; f < spec.num_frame; ++ f) {
+        // A later frame exists, the last full window counts
+        if (st.has_pending) {
+            batch.open_flow(false);
+            batch.add_window(st.pending.data());
+            owner.push_back(k);
+            st.has_pending = false;
+        }
+
+        const auto __add = [&] (const auto * const p_row) -> void {
+            for (size_t d = 0; d < dim; ++ d) {
+                st.win_sum[d] += p_row[d];
+                st.total_sum[d] += p_row[d];
+            }
+        };
+        if (spec.single) {
+            __add(spec.row32(f));
+        } else {
+            __add(spec.row(f));
+        }
+        ++ st.test_frame;
+        if (++ st.win_frame == win) {
+            for (size_t d = 0; d < dim; ++ d) {
+                st.pending[d] = st.win_sum[d] / win;
+                st.win_sum[d] = 0;
             }
+            st.win_frame = 0;
+            st.has_pending = true;
         }
+    }
+}
+
+
+void AnalyzerWorkerThread::transform_flow(const vector<size_t> & data, const index_range & _ve, 
+                                          flow_buffer_t & buf) const 
+{
+    const auto & store = *pkt_meta_ptr;
+    static const double_t min_interval_time = 1e-5;
+
+    // Inter-arrival times go to the flow buffer, the packet timestamps stay untouched
+    const size_t num_pkt = _ve.size();
+    buf.interval.resize(num_pkt);
+    buf.interval[0] = min_interval_time;
+    for (size_t i = 1; i < num_pkt; i ++) {
+        const double_t delta = store.ts[data[_ve[i]]] - store.ts[data[_ve[i - 1]]];
+        buf.interval[i] = delta <= 0 ? min_interval_time : delta;
+    }
+
+    // Weights straight into the STFT input, no copy of the signal
+    double_t * const p_input = p_stft->input(buf.padded, num_pkt);
+    for (size_t i = 0; i < num_pkt; i++) {
+        const size_t idx = data[_ve[i]];
+        p_input[i] = weight_kernel::packet_part(store.tp[idx], store.len[idx]);
+    }
+    weight_kernel::add_interval_part(buf.interval.data(), num_pkt, p_input);
+
+    p_stft->transform_input(buf.padded, num_pkt, buf.spec);
+    buf.spec.build_prefix();
+}
+
+
+void AnalyzerWorkerThread::train_flow(const spectrogram & spec) 
+{
+    // Once started the learner trains in the background on what it has, the flows
+    // from there on are tested and kept until its centers land
+    if (!p_learner->start_learn) {
+        if (p_analyzer_config->single_precision) {
+            add_train_windows<float>(spec);
+        } else {
+            add_train_windows<double_t>(spec);
+        }
+
+        if (p_learner->reach_learn()) {
+            if (p_analyzer_config->mode_verbose) LOGF("Analyer: trigger the training of learner.");
+            p_learner->start_train();
+        }
+    }
+
+    if (p_learner->start_learn) {
+        enter_execution();
+    }
+}
+
+
+// Window means of a training flow, in the precision the learner keeps them
+template<typename T>
+void AnalyzerWorkerThread::add_train_windows(const spectrogram & spec) 
+{
+    const size_t win = p_analyzer_config->mean_win_train;
+    if (spec.num_frame > win + 1 && !p_learner->reach_learn()) {
+        const size_t num_sample = p_analyzer_config->num_train_sample;
+        vector<T> data_to_add(num_sample * spec.num_bin);
+        for (size_t i = 0; i < num_sample; i ++) {
+            size_t start_index = (p_rng ? (*p_rng)() : rand()) % (spec.num_frame - 1 - win);
+            spec.window_mean(start_index, start_index + win, data_to_add.data() + i * spec.num_bin);
+        }
+        p_learner->add_train_data(data_to_add.data(), num_sample, spec.num_bin);
+    } else {
+        vector<T> data_to_add(spec.num_bin);
+        spec.window_mean(0, spec.num_frame, data_to_add.data());
+        p_learner->add_train_data(data_to_add.data(), 1, spec.num_bin);
+    }
+}
+
+
+// Flows are tested from here on, against the centers of the learner once published
+void AnalyzerWorkerThread::enter_execution() 
+{
+    analysis_start_time = __get_double_ts();
+
+    analysis_pkt_len = 0;
+    analysis_pkt_num = 0;
+
+    if (p_learner->finish_learn) {
+        take_centers();
+    }
+
+    if(p_analyzer_config->mode_verbose) LOGF("Analyer: enter execution mode.");
+    m_is_train = false;
+}
 
-        // test
-        else {
-            double min_dist = max_cluster_dist;
-            int assigned_cluster = -1;
-            if (ten_res.size(0) > p_analyzer_config->mean_win_test) {
-                double_t _max_dist = 0;
-                int _assigned_cluster = -1;
-                for (size_t i = 0; i + p_analyzer_config->mean_win_test < ten_res.size(0); i += p_analyzer_config->mean_win_test) {
-                    torch::Tensor tt = ten_res.slice(0, i, i + p_analyzer_config->mean_win_test).mean(0);
-            
-                    double_t _min_dist = max_cluster_dist;
-                    int _local_cluster = -1;
-                    for (size_t j = 0; j < centers.size(0); j++) {
-                        double d = torch::norm(tt - centers[j]).item<double_t>();
-                        if (d < _min_dist) {
-                            _min_dist = d;
-                            _local_cluster = j;
-                        }
-                    }
-            
-                    if (_min_dist > _max_dist) {
-                        _max_dist = _min_dist;
-                        _assigned_cluster = _local_cluster;
-                    }
+
+// End of the training part of the trace. A training still running is not waited for,
+// the test part is kept until its centers land rather than scored against none.
+void AnalyzerWorkerThread::leave_training() 
+{
+    if (!m_is_train) {
+        return;
+    }
+    if (!p_learner->start_learn) {
+        // Not enough data for the learner, the flows are scored against no centers
+        m_is_train = false;
+        m_centers_ready = true;
+        return;
+    }
+    enter_execution();
+}
+
+
+// Called from the worker pool while a part is tested
+void AnalyzerWorkerThread::defer_part(deferred_part_t && part) 
+{
+    lock_guard<mutex> lock(deferred_mtx);
+    deferred.push_back(move(part));
+}
+
+
+// Swaps in the centers published by the learner and scores the flows kept meanwhile
+void AnalyzerWorkerThread::take_centers() 
+{
+    scorer.set_centers(*p_learner->get_centers());
+    m_centers_ready = true;
+    if (deferred.empty()) {
+        return;
+    }
+
+    sort(deferred.begin(), deferred.end(), [] (const deferred_part_t & a, const deferred_part_t & b) -> bool {
+        return a.call != b.call ? a.call < b.call : a.from < b.from;
+    });
+    size_t num_flow = 0;
+    vector<const pair<double_t, int> *> owners;
+    vector<pair<double_t, int> > scores;
+    for (auto & part : deferred) {
+        if (part.owners.empty()) {
+            // One window per record
+            scorer.score(part.windows, scores);
+            num_flow += part.records.size();
+            for (size_t f = 0; f < part.records.size(); ++ f) {
+                auto & rec = part.records[f];
+                if (rec == nullptr) {
+                    continue;
                 }
-                min_dist = _max_dist;
-                assigned_cluster = _assigned_cluster;
-            } else {
-                torch::Tensor tt = ten_res.mean(0);
-                double_t _min_dist = max_cluster_dist;
-                int _local_cluster = -1;
-                for (size_t j = 0; j < centers.size(0); j++) {
-                    double d = torch::norm(tt - centers[j]).item<double_t>();
-                    if (d < _min_dist) {
-                        _min_dist = d;
-                        _local_cluster = j;
-                    }
+                rec->distence = scores[f].first;
+                rec->assigned_cluster = scores[f].second;
+                (rec->is_ipv6 ? flow6_records : flow4_records)->push_back(rec);
+            }
+        } else if (part.records.empty()) {
+            // One window per late score
+            scorer.score(part.windows, scores);
+            for (size_t w = 0; w < part.owners.size(); ++ w) {
+                auto & late = *part.owners[w];
+                if (scores[w].first > late.first) {
+                    late = scores[w];
                 }
-                min_dist = _min_dist;
-                assigned_cluster = _local_cluster;
+                owners.push_back(part.owners[w].get());
             }
-    
-            if (p_analyzer_config->save_to_file) {
-                // Convert local indices to global indices
-                vector<size_t> rid_vec;
-                rid_vec.reserve(_ve.size());
-                for(auto id : _ve) rid_vec.emplace_back(data[id]);
-
-                bool is_malicious = std::any_of(rid_vec.begin(), rid_vec.end(),
-                    [&](size_t idx) {return pkt_label_ptr->at(idx) == 1;}
-                );
-                
-                auto buf_loc = flow_record_t {
-                    .addr = iter_mp->first,
-                    .distence = min_dist, 
-                    .assigned_cluster = assigned_cluster, 
-                    .is_malicious = is_malicious,
-                    .pkt_indices = rid_vec  // Save global packet indices
-                };
-
-                auto buf_loc_ptr = make_shared<flow_record_t>(buf_loc);
-                flow4_records->push_back(buf_loc_ptr);
+        } else {
+            // Records of states, each with its late score so far
+            for (size_t f = 0; f < part.records.size(); ++ f) {
+                auto & rec = *part.records[f];
+                const auto & late = *part.owners[f];
+                if (late.first > rec.distence) {
+                    rec.distence = late.first;
+                    rec.assigned_cluster = late.second;
+                }
+                (rec.is_ipv6 ? flow6_records : flow4_records)->push_back(part.records[f]);
             }
         }
     }
+    sort(owners.begin(), owners.end());
+    num_flow += unique(owners.begin(), owners.end()) - owners.begin();
+    deferred.clear();
+
+    LOGF("Analyer: scored %ld flows tested while the learner trained.", num_flow);
 }
 
 
-// 2020.12.8
-auto inline AnalyzerWorkerThread::weight_transform(const shared_ptr<Whisper::basic_packet> info) -> double_t 
+// Takes the centers if the learner published them, without waiting
+void AnalyzerWorkerThread::poll_centers() 
 {
-    uint16_t tp_value = 10;
-    switch (info->tp)
-    {
-    case 5:
-        tp_value = 10;      // TYPE_ICMP 		= 10,
-        break;
-    case 17: 
-        tp_value = 1;       // TYPE_TCP_SYN 	= 1
-        break;
-    case 33:
-        tp_value = 1000;    // TYPE_TCP_ACK 	= 1000
-        break;
-    case 49:
-        tp_value = 1001;    // TYPE_TCP_ACK + TYPE_TCP_SYN 	= 1001
-        break;
-    case 97:
-        tp_value = 40;      // TYPE_TCP_FIN 	= 40
-        break;
-    case 129:
-        tp_value = 1;       // TYPE_TCP_RST 	= 1
-        break;
-    case 161:
-        tp_value = 1;       // TYPE_TCP_RST + TYPE_TCP_ACK 	= 2
-        break;
-    case 257:
-        tp_value = 3;       // TYPE_UDP 		= 3
-        break;
-    default:
-        break;
+    if (!m_centers_ready && !m_is_train && p_learner->finish_learn) {
+        take_centers();
+    }
+}
+
+
+// Waits for the training running in the background, if any, only once the trace is done
+void AnalyzerWorkerThread::await_centers() 
+{
+    if (m_centers_ready || m_is_train || !p_learner->start_learn) {
+        return;
+    }
+    p_learner->wait_train();
+    take_centers();
+}
+
+
+// Once the centers landed every kept window is scored, the late score joins the score
+void AnalyzerWorkerThread::settle_score(flow_state & st) const 
+{
+    if (st.p_late == nullptr || !m_centers_ready) {
+        return;
+    }
+    if (st.p_late->first > st.score.first) {
+        st.score = *st.p_late;
+    }
+    st.p_late = nullptr;
+}
+
+
+void AnalyzerWorkerThread::collect_windows(const spectrogram & spec, window_batch & batch) const 
+{
+    const size_t win = p_analyzer_config->mean_win_test;
+    if (spec.num_frame > win) {
+        batch.open_flow(true);
+        for (size_t i = 0; i + win < spec.num_frame; i += win) {
+            batch.add_mean(spec, i, i + win);
+        }
+    } else {
+        batch.open_flow(false);
+        batch.add_mean(spec, 0, spec.num_frame);
+    }
+}
+
+
+auto AnalyzerWorkerThread::make_record(const vector<size_t> & data, const index_range & _ve, 
+                                       const pair<double_t, int> & score) const -> shared_ptr<flow_record_t> 
+{
+    if (!p_analyzer_config->save_to_file) {
+        return nullptr;
+    }
+
+    // Convert local indices to global indices
+    vector<size_t> rid_vec;
+    rid_vec.reserve(_ve.size());
+    for(auto id : _ve) rid_vec.emplace_back(data[id] + pkt_index_base);
+
+    bool is_malicious = std::any_of(rid_vec.begin(), rid_vec.end(),
+        [&](size_t idx) {return pkt_label_ptr->at(idx - pkt_index_base) == 1;}
+    );
+    
+    auto buf_loc = flow_record_t {
+        .addr = 0,
+        .distence = score.first, 
+        .assigned_cluster = score.second, 
+        .is_malicious = is_malicious,
+        .pkt_indices = rid_vec  // Save global packet indices
+    };
+
+    return make_shared<flow_record_t>(buf_loc);
+}
+
+
+auto AnalyzerWorkerThread::make_record(flow_state & st) const -> shared_ptr<flow_record_t> 
+{
+    if (!p_analyzer_config->save_to_file) {
+        return nullptr;
     }
-    return info->len * 10.0 + tp_value / 10.0 + -log2(info->ts) * 15.68;
+
+    auto buf_loc = flow_record_t {
+        .addr = 0,
+        .distence = st.score.first, 
+        .assigned_cluster = st.score.second, 
+        .is_malicious = st.is_malicious,
+        .pkt_indices = move(st.pkt_indices)
+    };
+
+    return make_shared<flow_record_t>(move(buf_loc));
 }
 
 
+// An IPv4 source address keeps the numeric addr field, any other key is written as JSON
+template<typename K>
+void AnalyzerWorkerThread::label_record(flow_record_t & rec, const K & key, const bool is_ipv6) const 
+{
+    rec.is_ipv6 = is_ipv6;
+    if constexpr (is_same<K, pkt_addr4_t>::value) {
+        rec.addr = key;
+    } else {
+        rec.key = flow_key_json(key);
+    }
+}
+
+
+
+
 auto AnalyzerWorkerThread::get_overall_performance() const -> pair<double_t, double_t> 
 {
 	return {
@@ -281,7 +1180,9 @@ auto AnalyzerWorkerThread::get_overall_performance() const -> pair<double_t, dou
 }
 
 
-auto AnalyzerWorkerThread::save_res_json() const -> bool 
+// The result file is written while the trace is analyzed, "Results" is one array with
+// the records of every chunk, IPv6 ones after the IPv4 ones of the same chunk
+auto AnalyzerWorkerThread::open_results() -> bool 
 {
 	if (access(p_analyzer_config->save_dir.c_str(), 0) == -1) {
         system(("mkdir " + p_analyzer_config->save_dir).c_str());
@@ -299,37 +1200,64 @@ auto AnalyzerWorkerThread::save_res_json() const -> bool
         << p_analyzer_config->save_file_prefix 
         // << time_buf
         << ".json";
-    string file_name = oss.str();
+    result_file = oss.str();
 
-    json j_array;
-    
-    for(size_t i = 0; i < flow4_records->size(); i ++) {
-        json _j;
-        const auto& cur_flow_record = flow4_records->at(i);
-        _j.push_back(cur_flow_record->addr);
-        _j.push_back(cur_flow_record->distence);
-        _j.push_back(cur_flow_record->assigned_cluster);
-        _j.push_back(cur_flow_record->is_malicious);
-        // Add packet indices for packet-level evaluation
-        json idx_array;
-        for(auto idx : cur_flow_record->pkt_indices) {
-            idx_array.push_back(idx);
-        }
-        _j.push_back(idx_array);
-        j_array.push_back(_j);
-    }
-
-    json j_res;
-    j_res["Results"] = j_array;
-    ofstream of(file_name);
-    if (of) {
-        of << j_res;
-        of.close();
-        printf("Analyzer: save result to %s \n", file_name.c_str());
-        return true;
-    } else {
+    result_fs.open(result_file);
+    if (!result_fs) {
+        WARNF("Analyzer: open result file %s failed.", result_file.c_str());
+        return false;
+    }
+    result_fs << "{\"Results\":[";
+    num_result = 0;
+    return true;
+}
+
+
+// Appends the records gathered so far to the result file, they are not kept
+void AnalyzerWorkerThread::write_records() 
+{
+    if (!result_fs.is_open()) {
+        return;
+    }
+    for (const auto & p_records : {flow4_records, flow6_records}) {
+        for(size_t i = 0; i < p_records->size(); i ++) {
+            json _j;
+            const auto& cur_flow_record = p_records->at(i);
+            if (!cur_flow_record->key.is_null()) {
+                _j.push_back(cur_flow_record->key);
+            } else {
+                _j.push_back(cur_flow_record->addr);
+            }
+            _j.push_back(cur_flow_record->distence);
+            _j.push_back(cur_flow_record->assigned_cluster);
+            _j.push_back(cur_flow_record->is_malicious);
+            // Add packet indices for packet-level evaluation
+            json idx_array;
+            for(auto idx : cur_flow_record->pkt_indices) {
+                idx_array.push_back(idx);
+            }
+            _j.push_back(idx_array);
+            result_fs << (num_result ++ > 0 ? "," : "") << _j;
+        }
+        p_records->clear();
+    }
+}
+
+
+auto AnalyzerWorkerThread::close_results() -> bool 
+{
+    if (!result_fs.is_open()) {
+        return false;
+    }
+    write_records();
+    result_fs << "]}";
+    result_fs.close();
+    if (!result_fs) {
+        WARNF("Analyzer: write result file %s failed.", result_file.c_str());
         return false;
     }
+    printf("Analyzer: save result to %s \n", result_file.c_str());
+    return true;
 }
 
 
@@ -374,6 +1302,64 @@ auto AnalyzerWorkerThread::configure_via_json(const json & jin) -> bool
             p_analyzer_config->num_train_sample = 
                 static_cast<decltype(p_analyzer_config->num_train_sample)>(jin["num_train_sample"]);
         }
+        if (jin.count("precision")) {
+            const string _precision = jin["precision"];
+            if (_precision != "double" && _precision != "float") {
+                WARNF("Invalid precision: %s.", _precision.c_str());
+                throw logic_error("Parse error Json tag: precision\n");
+            }
+            p_analyzer_config->single_precision = _precision == "float";
+        }
+        if (jin.count("flow_continuation")) {
+            p_analyzer_config->flow_continuation = 
+                static_cast<decltype(p_analyzer_config->flow_continuation)>(jin["flow_continuation"]);
+        }
+        if (jin.count("flow_key")) {
+            const string _key = jin["flow_key"];
+            const auto _end = flow_key_names + sizeof(flow_key_names) / sizeof(flow_key_names[0]);
+            const auto _it = find(flow_key_names, _end, _key);
+            if (_it == _end) {
+                WARNF("Invalid flow key: %s.", _key.c_str());
+                throw logic_error("Parse error Json tag: flow_key\n");
+            }
+            p_analyzer_config->flow_key = static_cast<flow_key_t>(_it - flow_key_names);
+        }
+        if (jin.count("max_flows")) {
+            p_analyzer_config->max_flows = 
+                static_cast<decltype(p_analyzer_config->max_flows)>(jin["max_flows"]);
+            if (p_analyzer_config->max_flows == 0) {
+                WARNF("Invalid flow table size.");
+                throw logic_error("Parse error Json tag: max_flows\n");
+            }
+        }
+        if (jin.count("max_flow_packets")) {
+            p_analyzer_config->max_flow_packets = 
+                static_cast<decltype(p_analyzer_config->max_flow_packets)>(jin["max_flow_packets"]);
+            if (p_analyzer_config->max_flow_packets == 0) {
+                WARNF("Invalid packets per flow record.");
+                throw logic_error("Parse error Json tag: max_flow_packets\n");
+            }
+        }
+        if (jin.count("max_table_mb")) {
+            p_analyzer_config->max_table_mb = 
+                static_cast<decltype(p_analyzer_config->max_table_mb)>(jin["max_table_mb"]);
+            if (p_analyzer_config->max_table_mb == 0) {
+                WARNF("Invalid flow table memory bound.");
+                throw logic_error("Parse error Json tag: max_table_mb\n");
+            }
+        }
+        if (jin.count("idle_timeout")) {
+            p_analyzer_config->idle_timeout = 
+                static_cast<decltype(p_analyzer_config->idle_timeout)>(jin["idle_timeout"]);
+        }
+        if (jin.count("active_timeout")) {
+            p_analyzer_config->active_timeout = 
+                static_cast<decltype(p_analyzer_config->active_timeout)>(jin["active_timeout"]);
+        }
+        if (jin.count("parallel_flow")) {
+            p_analyzer_config->parallel_flow = 
+                static_cast<decltype(p_analyzer_config->parallel_flow)>(jin["parallel_flow"]);
+        }
         if (jin.count("train_ratio")) {
             p_analyzer_config->train_ratio = 
                 static_cast<decltype(p_analyzer_config->train_ratio)>(jin["train_ratio"]);
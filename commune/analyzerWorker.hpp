@@ -3,11 +3,23 @@
 #include "../common.hpp"
 #include "whisper_common.hpp"
 #include "packet_basic.hpp"
+#include "packet_store.hpp"
+#include "packet_stream.hpp"
+#include "stft_kernel.hpp"
+#include "weight_kernel.hpp"
+#include "center_scorer.hpp"
+#include "flow_state.hpp"
+#include "flow_table.hpp"
+#include "flow_key.hpp"
+#include "flow_group.hpp"
+#include "worker_pool.hpp"
 #include "parserWorker.hpp"
 #include "kMeansLearner.hpp"
 #include "flow_define.hpp"
 
-#include <torch/torch.h>
+#include <deque>
+#include <mutex>
+#include <random>
 
 
 namespace Whisper
@@ -33,6 +45,31 @@ struct AnalyzerConfigParam final {
 
     double_t train_ratio = 0.75;
 
+    // Analyze the flows of a chunk on the worker pool
+    bool parallel_flow = false;
+
+    // Spectra, window means, the training set and center distances in float,
+    // JSON "precision": "float"
+    bool single_precision = false;
+
+    // What packets make a flow: source address, address pair or 4-tuple
+    flow_key_t flow_key = FLOW_KEY_SRC_ADDR;
+
+    // Carry per-flow state across chunks, flows are scored once at the end of the trace
+    bool flow_continuation = false;
+    // Bound of the flow table, addresses beyond it evict the least recently seen ones
+    size_t max_flows = 1 << 18;
+    // A tested flow gets a record every max_flow_packets packets, so the packet indices
+    // a flow keeps for its record stay bounded
+    size_t max_flow_packets = 1 << 16;
+    // Trace time after which a silent address, or any address, is scored and forgotten
+    // 0 disables the timeout
+    double_t idle_timeout = 60.0;
+    double_t active_timeout = 0;
+    // Bound of the flow tables with what their flows hold, in MB. Beyond it the least
+    // recently seen flows are scored and forgotten at the end of a chunk.
+    size_t max_table_mb = 1024;
+
     // Save results to file
     bool save_to_file = false;
     // File path
@@ -58,6 +95,20 @@ struct AnalyzerConfigParam final {
 
         printf("Frequency domain analysis realated param:\n");
         printf("FFT component size: %ld\n", n_fft);
+        printf("Flow key: %s\n", flow_key_names[flow_key]);
+        if (single_precision) {
+            printf("Precision: float\n");
+        }
+        if (parallel_flow) {
+            printf("Parallel flow analysis: on\n");
+        }
+        if (flow_continuation) {
+            printf("Flow continuation across chunks: on\n");
+            printf("Max. flows: %ld, Idle timeout: %4.2lfs, Active timeout: %4.2lfs\n", 
+            max_flows, idle_timeout, active_timeout);
+            printf("Max. packets per flow record: %ld, Max. flow table memory: %ld MB\n", 
+            max_flow_packets, max_table_mb);
+        }
 
         if (save_to_file) {
             printf("Saving related param:\n");
@@ -93,8 +144,11 @@ class AnalyzerWorkerThread final {
 private:
     bool m_is_train = true;
 
-	shared_ptr<vector<shared_ptr<basic_packet>>> pkt_meta_ptr;
+	// Read only, may be shared with other analyzers
+	shared_ptr<const packet_store> pkt_meta_ptr;
     shared_ptr<vector<uint8_t>> pkt_label_ptr;
+    // Global index of pkt_meta_ptr[0], non-zero while streaming
+    size_t pkt_index_base = 0;
 
 	uint64_t analysis_pkt_len = 0;
 	uint64_t analysis_pkt_num = 0;
@@ -103,34 +157,155 @@ private:
 	double_t analysis_start_time, analysis_end_time;
 
     // The result of train, i.e. the clustring centers
-    torch::Tensor centers;
+    center_scorer scorer;
 
     shared_ptr<KMeansLearner> p_learner;
     shared_ptr<AnalyzerConfigParam> p_analyzer_config;
 
+    // Generator of the training sampler, rand() when not set
+    shared_ptr<mt19937> p_rng;
+
+    // Spectral transform of the current n_fft
+    shared_ptr<const stft_kernel> p_stft;
+
+    // Shared worker pool, may be null
+    shared_ptr<worker_pool> p_worker_pool;
+
     typedef struct {
         uint32_t addr;
         double_t distence;
         int assigned_cluster;
         bool is_malicious;
         vector<size_t> pkt_indices;  // Global packet indices for this flow
+        bool is_ipv6;
+        json key;                    // Flow key other than an IPv4 source, written instead of addr
     }  flow_record_t;
 
+    // Puts the key of flow k on its record
+    using record_labeler_t = function<void(const size_t, flow_record_t &)>;
+
+    // Records of the current chunk, appended to the result file when it is done
     shared_ptr<vector<shared_ptr<flow_record_t>>> flow4_records;
-    // shared_ptr<vector<shared_ptr<tuple5_flow6>>> flow6_records;
+    shared_ptr<vector<shared_ptr<flow_record_t>>> flow6_records;
+
+    ofstream result_fs;
+    string result_file;
+    size_t num_result = 0;
+
+    typedef struct {
+        vector<double_t> interval;
+        vector<double_t> padded;
+        spectrogram spec;
+        window_batch windows;
+        vector<size_t> owner;
+        vector<pair<double_t, int> > scores;
+    }  flow_buffer_t;
+
+    // One per flow of a training block, only [0] in serial mode
+    vector<flow_buffer_t> flow_buffers;
+
+    // The scorer holds the centers of the learner, or none as no training started in time
+    bool m_centers_ready = false;
+
+    // Windows of the flows tested while the learner still trains in the background, scored
+    // in (call, from) order once its centers land. A part owns what it scores: the record
+    // of each window, or under flow_continuation the late score of the state each window
+    // belongs to. A part of records alone takes the late scores of their states as they
+    // stand at its place in that order, after every window kept before the record was made.
+    struct deferred_part_t {
+        size_t call;
+        size_t from;
+        window_batch windows;
+        vector<shared_ptr<flow_record_t> > records;
+        vector<shared_ptr<pair<double_t, int> > > owners;
+    };
+    vector<deferred_part_t> deferred;
+    mutex deferred_mtx;
+    // Calls of analyze_flows and advance_flows so far
+    size_t num_call = 0;
+
+    // Packets of the current chunk by flow key, IPv4 source addresses as they are
+    // and any other key by its id
+    flow_groups groups4;
+    flow_groups groups6;
+    vector<size_t> pos4;
+    vector<size_t> pos6;
+
+    // Key ids and flow_continuation state of one flow key policy
+    template<typename P>
+    struct flow_key_ctx {
+        key_ids<typename P::key4_t> ids4;
+        key_ids<typename P::key6_t> ids6;
+        shared_ptr<flow_table<flow_state, typename P::key4_t> > p_table4;
+        shared_ptr<flow_table<flow_state, typename P::key6_t> > p_table6;
+    };
+    // Only the one of the configured policy is used
+    tuple<flow_key_ctx<src_addr_key>, flow_key_ctx<addr_pair_key>, flow_key_ctx<tuple4_key> > key_ctxs;
 
     const double_t max_cluster_dist = 1e12;
+    // The expiry hand goes round a flow table in this many chunks
+    const size_t expire_chunks = 16;
 
     void wave_analyze(vector<size_t> data);
-    auto static inline weight_transform(const shared_ptr<Whisper::basic_packet> info) -> double_t;
+    template<typename F>
+    void with_flow_key(F && __fn);
+    template<typename P>
+    void group_flows(const vector<size_t> & data, flow_key_ctx<P> & ctx);
+    template<typename P>
+    void analyze_flows(const vector<size_t> & data, flow_key_ctx<P> & ctx);
+    void transform_flow(const vector<size_t> & data, const index_range & _ve, flow_buffer_t & buf) const;
+    void train_flow(const spectrogram & spec);
+    template<typename T>
+    void add_train_windows(const spectrogram & spec);
+    void enter_execution();
+    void leave_training();
+    void defer_part(deferred_part_t && part);
+    void take_centers();
+    void poll_centers();
+    void await_centers();
+    void settle_score(flow_state & st) const;
+    void collect_windows(const spectrogram & spec, window_batch & batch) const;
+
+    template<typename P>
+    void continue_flows(const vector<size_t> & data, flow_key_ctx<P> & ctx);
+    template<typename K, typename F>
+    void continue_family(const vector<size_t> & data, const flow_groups & groups, 
+                         shared_ptr<flow_table<flow_state, K> > & p_table, const bool is_ipv6, F && key_of);
+    template<typename K>
+    void expire_family(flow_table<flow_state, K> & table, const bool is_ipv6, 
+                       const double_t now, const size_t max_bytes);
+    void flush_flows();
+    template<typename K>
+    void flush_family(shared_ptr<flow_table<flow_state, K> > & p_table, const bool is_ipv6);
+    template<typename K>
+    void flush_states(const vector<K> & keys, const bool is_ipv6, deque<flow_state> & states);
+    void advance_flows(const vector<size_t> * data, const record_labeler_t & __label, 
+                       const vector<index_range> & ve_list, 
+                       const vector<flow_state *> & states, const bool flush);
+    void extend_flow(flow_state & st, const vector<size_t> & data, const index_range & _ve, flow_buffer_t & buf) const;
+    void finish_flow(flow_state & st, flow_buffer_t & buf) const;
+    void cut_frames(flow_state & st, flow_buffer_t & buf) const;
+    void record_packets(flow_state & st, const vector<size_t> & data, const index_range & _ve) const;
+    void push_test_frames(flow_state & st, const spectrogram & spec, 
+                          window_batch & batch, vector<size_t> & owner, const size_t k) const;
+    auto make_record(flow_state & st) const -> shared_ptr<flow_record_t>;
+    auto make_record(const vector<size_t> & data, const index_range & _ve, 
+                     const pair<double_t, int> & score) const -> shared_ptr<flow_record_t>;
+    template<typename K>
+    void label_record(flow_record_t & rec, const K & key, const bool is_ipv6) const;
+
+    auto open_results() -> bool;
+    void write_records();
+    auto close_results() -> bool;
 
 public:
 
     AnalyzerWorkerThread(
-        const shared_ptr<vector<shared_ptr<basic_packet>>> _pkt_meta_ptr, 
+        const shared_ptr<const packet_store> _pkt_meta_ptr, 
         const shared_ptr<vector<uint8_t>> _pkt_label_ptr,
-        const shared_ptr<KMeansLearner> _pl
-    ): pkt_meta_ptr(_pkt_meta_ptr), p_learner(_pl), pkt_label_ptr(_pkt_label_ptr) {}
+        const shared_ptr<KMeansLearner> _pl,
+        const shared_ptr<worker_pool> _pool = nullptr
+    ): pkt_meta_ptr(_pkt_meta_ptr), p_learner(_pl), pkt_label_ptr(_pkt_label_ptr), p_worker_pool(_pool) {}
 
     virtual ~AnalyzerWorkerThread() {}
     AnalyzerWorkerThread & operator=(const AnalyzerWorkerThread &) = delete;
@@ -138,9 +313,15 @@ public:
 
     bool run();
 
-    auto configure_via_json(const json & jin) -> bool;
+    // Sample training windows from a private generator instead of rand()
+    void inline set_rand_seed(const uint32_t seed) {
+        p_rng = make_shared<mt19937>(seed);
+    }
+
+    // Consume batches until the queue is closed, num_pkt is the trace length for the train split
+    bool run_stream(const shared_ptr<packet_batch_pipe> p_pipe, const size_t num_pkt);
 
-    auto save_res_json() const -> bool;
+    auto configure_via_json(const json & jin) -> bool;
 
     auto get_overall_performance() const -> pair<double_t, double_t>;
 
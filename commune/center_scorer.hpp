@@ -0,0 +1,226 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "stft_kernel.hpp"
+
+#include <mlpack/core.hpp>
+
+namespace Whisper
+{
+
+// Window means of a group of flows, scored together by center_scorer.
+// means holds one dim-sized column per window, the windows of flow f are
+// [flow_begin[f], flow_begin[f + 1]). In single precision the columns are
+// in means32 instead, the means themselves are still taken in double.
+struct window_batch final {
+    size_t dim = 0;
+    bool single = false;
+    vector<double_t> means;
+    vector<float> means32;
+    vector<size_t> flow_begin{0};
+    // Score of a windowed flow is its farthest window, otherwise its only window
+    vector<uint8_t> flow_windowed;
+
+    void reset(const size_t _dim, const bool _single = false) {
+        dim = _dim;
+        single = _single;
+        means.clear();
+        means32.clear();
+        flow_begin.assign(1, 0);
+        flow_windowed.clear();
+    }
+
+    inline auto num_flow() const -> size_t {
+        return flow_windowed.size();
+    }
+
+    inline auto num_window() const -> size_t {
+        return flow_begin.back();
+    }
+
+    void open_flow(const bool windowed) {
+        flow_windowed.push_back(windowed);
+        flow_begin.push_back(flow_begin.back());
+    }
+
+    // Next window of the open flow, the mean of frames [_from, _to) of spec
+    void add_mean(const spectrogram & spec, const size_t _from, const size_t _to) {
+        if (single) {
+            spec.window_mean(_from, _to, add_column(means32));
+        } else {
+            spec.window_mean(_from, _to, add_column(means));
+        }
+    }
+
+    // Next window of the open flow, a mean of dim values taken by the caller
+    void add_window(const double_t * const p_mean) {
+        if (single) {
+            copy(p_mean, p_mean + dim, add_column(means32));
+        } else {
+            copy(p_mean, p_mean + dim, add_column(means));
+        }
+    }
+
+private:
+
+    template<typename T>
+    auto add_column(vector<T> & columns) -> T * {
+        columns.resize(columns.size() + dim);
+        ++ flow_begin.back();
+        return columns.data() + columns.size() - dim;
+    }
+};
+
+
+// Nearest-center search for the test phase. All windows of a batch are compared to
+// all centers with a single matrix product, using |a - c|^2 = |a|^2 + |c|^2 - 2 a.c.
+// |a|^2 does not change the arg min of a window, and the distance to the chosen center
+// is then recomputed directly, so no cancellation error reaches the reported score.
+//
+// In single precision the centers, the product and the distances are float, for
+// twice the SIMD width and half the memory traffic; the batches must be single too.
+class center_scorer final {
+
+private:
+
+    // dim x num_center, one center per column, with the squared norm of each
+    template<typename T>
+    struct center_set {
+        arma::Mat<T> centers;
+        vector<T> center_sq;
+    };
+
+    size_t dim = 0;
+    size_t num_center = 0;
+    double_t max_dist = 1e12;
+    bool single = false;
+
+    center_set<double_t> set64;
+    center_set<float> set32;
+
+    template<typename T>
+    void load(center_set<T> & cs, const arma::mat & _centers) {
+        cs.centers.set_size(dim, num_center);
+        cs.center_sq.assign(num_center, 0);
+        for (size_t j = 0; j < num_center; ++ j) {
+            const double_t * const p_src = _centers.colptr(j);
+            T * const p_c = cs.centers.colptr(j);
+            for (size_t d = 0; d < dim; ++ d) {
+                p_c[d] = static_cast<T>(p_src[d]);
+                cs.center_sq[j] += p_c[d] * p_c[d];
+            }
+        }
+    }
+
+    // Nearest center of every window of means, (distance, center) or (max_dist, -1)
+    template<typename T>
+    void nearest_centers(const center_set<T> & cs, const vector<T> & means, const size_t num_window,
+                         vector<pair<double_t, int> > & nearest) const {
+        const arma::Mat<T> windows(const_cast<T *>(means.data()), dim, num_window, false, true);
+        arma::Mat<T> gram;
+        gram = cs.centers.t() * windows;
+
+        nearest.resize(num_window);
+        for (size_t w = 0; w < num_window; ++ w) {
+            const T * const p_g = gram.colptr(w);
+            T best = 0;
+            int best_j = -1;
+            for (size_t j = 0; j < num_center; ++ j) {
+                const T partial = cs.center_sq[j] - 2 * p_g[j];
+                if (best_j < 0 || partial < best) {
+                    best = partial;
+                    best_j = j;
+                }
+            }
+
+            const T * const p_a = windows.colptr(w);
+            const T * const p_c = cs.centers.colptr(best_j);
+            T sq = 0;
+            #pragma omp simd reduction(+:sq)
+            for (size_t d = 0; d < dim; ++ d) {
+                sq += (p_a[d] - p_c[d]) * (p_a[d] - p_c[d]);
+            }
+            const double_t dist = sqrt(sq);
+            nearest[w] = dist < max_dist ? make_pair(dist, best_j) : make_pair(max_dist, -1);
+        }
+    }
+
+public:
+
+    center_scorer() = default;
+    center_scorer & operator=(const center_scorer &) = delete;
+    center_scorer(const center_scorer &) = delete;
+
+    // num_center centers at the origin, what the analyzer tests with before training ends
+    void reset(const size_t _num_center, const size_t _dim, const double_t _max_dist, const bool _single = false) {
+        dim = _dim;
+        num_center = _num_center;
+        max_dist = _max_dist;
+        single = _single;
+        set64 = center_set<double_t>();
+        set32 = center_set<float>();
+        if (single) {
+            set32.centers.zeros(dim, num_center);
+            set32.center_sq.assign(num_center, 0);
+        } else {
+            set64.centers.zeros(dim, num_center);
+            set64.center_sq.assign(num_center, 0);
+        }
+    }
+
+    // One center per column, as the learner publishes them
+    void set_centers(const arma::mat & _centers) {
+        num_center = _centers.n_cols;
+        dim = num_center > 0 ? _centers.n_rows : dim;
+        if (single) {
+            load(set32, _centers);
+        } else {
+            load(set64, _centers);
+        }
+    }
+
+    inline auto get_dim() const -> size_t {
+        return dim;
+    }
+
+    inline auto is_single() const -> bool {
+        return single;
+    }
+
+    // (distance, cluster) of every flow of the batch, cluster is -1 when no center is
+    // closer than max_dist, or for a windowed flow when every window sits on a center
+    void score(const window_batch & batch, vector<pair<double_t, int> > & res) const {
+        assert(batch.dim == dim && batch.single == single);
+        const size_t num_window = batch.num_window();
+        res.assign(batch.num_flow(), {max_dist, -1});
+        if (num_window == 0 || num_center == 0) {
+            return;
+        }
+
+        vector<pair<double_t, int> > nearest;
+        if (single) {
+            nearest_centers(set32, batch.means32, num_window, nearest);
+        } else {
+            nearest_centers(set64, batch.means, num_window, nearest);
+        }
+
+        for (size_t f = 0; f < batch.num_flow(); ++ f) {
+            const size_t _from = batch.flow_begin[f], _to = batch.flow_begin[f + 1];
+            if (!batch.flow_windowed[f]) {
+                if (_from < _to) {
+                    res[f] = nearest[_from];
+                }
+                continue;
+            }
+            res[f] = {0, -1};
+            for (size_t w = _from; w < _to; ++ w) {
+                if (nearest[w].first > res[f].first) {
+                    res[f] = nearest[w];
+                }
+            }
+        }
+    }
+};
+
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "packet_info.hpp"
+
+namespace Whisper
+{
+
+// Allocation-free cursor over one blank-separated text record, i.e. the
+// "4 sIP dIP sPort dPort ts tp len" lines of the .data traces.
+// Numbers are decoded in place, without locale lookup or string copies.
+class field_parser final {
+
+private:
+
+    const char * cur;
+    const char * const end;
+
+    // Exact powers of ten representable by a double
+    static constexpr double_t pow10_tab[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+        1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    static inline auto is_digit(const char c) -> bool {
+        return static_cast<unsigned char>(c - '0') < 10;
+    }
+
+    inline void skip_blank() {
+        while (cur < end && (*cur == ' ' || *cur == '\t')) ++ cur;
+    }
+
+public:
+
+    field_parser(const char * str, const char * const str_end): cur(str), end(str_end) {}
+    explicit field_parser(const string & str): cur(str.data()), end(str.data() + str.size()) {}
+    // The cursor does not own the text, a temporary would dangle
+    explicit field_parser(string &&) = delete;
+
+    field_parser & operator=(const field_parser &) = delete;
+    field_parser(const field_parser &) = delete;
+
+    inline auto done() const -> bool {
+        return cur >= end;
+    }
+
+    // Unsigned decimal integer. Out of range, it saturates at the maximum and fails,
+    // like the stream extraction does.
+    template<typename T>
+    inline auto next_uint(T & val) -> bool {
+        skip_blank();
+        const char * const str = cur;
+        const T max_val = static_cast<T>(~static_cast<T>(0));
+        bool overflow = false;
+        for (val = 0; cur < end && is_digit(*cur); ++ cur) {
+            const T digit = static_cast<T>(*cur - '0');
+            if (overflow || val > (max_val - digit) / 10) {
+                overflow = true;
+                continue;
+            }
+            val = val * 10 + digit;
+        }
+        if (overflow) {
+            val = max_val;
+            return false;
+        }
+        return cur != str;
+    }
+
+    // Signed decimal integer
+    template<typename T>
+    inline auto next_int(T & val) -> bool {
+        skip_blank();
+        const bool neg = cur < end && *cur == '-';
+        if (neg || (cur < end && *cur == '+')) ++ cur;
+        typename make_unsigned<T>::type _u;
+        if (!next_uint(_u)) {
+            return false;
+        }
+        val = neg ? -static_cast<T>(_u) : static_cast<T>(_u);
+        return true;
+    }
+
+    // The IPv6 addresses in the traces are plain 128-bit decimals
+    inline auto next_uint128(pkt_addr6_t & val) -> bool {
+        return next_uint(val);
+    }
+
+    // Decimal floating point number.
+    // Short mantissas with small exponents (all timestamps in the traces) are
+    // converted exactly by a single multiplication or division; anything else
+    // falls back to from_chars().
+    inline auto next_double(double_t & val) -> bool {
+        skip_blank();
+        const char * const str = cur;
+        const bool neg = cur < end && *cur == '-';
+        if (neg || (cur < end && *cur == '+')) ++ cur;
+
+        // Leading zeros do not count against the exact-mantissa budget
+        uint64_t mantissa = 0;
+        int n_digit = 0, exp10 = 0;
+        bool has_digit = false;
+        for (; cur < end && is_digit(*cur); ++ cur, has_digit = true) {
+            mantissa = mantissa * 10 + (*cur - '0');
+            n_digit += mantissa != 0;
+        }
+        if (cur < end && *cur == '.') {
+            for (++ cur; cur < end && is_digit(*cur); ++ cur, -- exp10, has_digit = true) {
+                mantissa = mantissa * 10 + (*cur - '0');
+                n_digit += mantissa != 0;
+            }
+        }
+        if (!has_digit) {
+            cur = str;
+            return false;
+        }
+        if (cur < end && (*cur == 'e' || *cur == 'E')) {
+            const char * _exp = cur + 1;
+            const bool exp_neg = _exp < end && *_exp == '-';
+            if (exp_neg || (_exp < end && *_exp == '+')) ++ _exp;
+            if (_exp < end && is_digit(*_exp)) {
+                int _e = 0;
+                for (; _exp < end && is_digit(*_exp); ++ _exp) {
+                    _e = min(_e * 10 + (*_exp - '0'), 9999);
+                }
+                exp10 += exp_neg ? -_e : _e;
+                cur = _exp;
+            }
+        }
+
+        if (n_digit <= 19 && mantissa <= (1ull << 53) && exp10 >= -22 && exp10 <= 22) {
+            val = (double_t) mantissa;
+            val = exp10 < 0 ? val / pow10_tab[-exp10] : val * pow10_tab[exp10];
+            if (neg) val = -val;
+            return true;
+        }
+
+        // from_chars() takes a '-' but no '+'
+        const auto res = from_chars(str < end && *str == '+' ? str + 1 : str, end, val);
+        cur = res.ptr;
+        return res.ec == errc();
+    }
+};
+
+}
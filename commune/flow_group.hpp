@@ -0,0 +1,186 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "packet_info.hpp"
+#include "flow_key.hpp"
+
+namespace Whisper
+{
+
+// Positions of the packets of one flow in its chunk, in arrival order
+struct index_range final {
+    const size_t * p_begin = nullptr;
+    size_t len = 0;
+
+    inline auto size() const -> size_t {
+        return len;
+    }
+
+    inline auto operator[](const size_t i) const -> size_t {
+        return p_begin[i];
+    }
+
+    inline auto begin() const -> const size_t * {
+        return p_begin;
+    }
+
+    inline auto end() const -> const size_t * {
+        return p_begin + len;
+    }
+};
+
+
+// Packets of a chunk grouped by a 32-bit key. Positions are sorted by key with a stable
+// LSD radix sort, so each key owns one contiguous range of a single index array, still
+// in arrival order, and keys come out ascending. Buffers keep their capacity from one
+// chunk to the next, nothing is allocated per key.
+class flow_groups final {
+
+private:
+
+    static constexpr size_t radix_bits = 11;
+    static constexpr size_t radix = 1 << radix_bits;
+    static constexpr size_t num_pass = (32 + radix_bits - 1) / radix_bits;
+
+    vector<uint32_t> keys, keys_tmp;
+    vector<size_t> index, index_tmp;
+    vector<size_t> count;
+
+    vector<uint32_t> flow_keys;
+    vector<size_t> offsets;
+
+public:
+
+    flow_groups() = default;
+    flow_groups & operator=(const flow_groups &) = delete;
+    flow_groups(const flow_groups &) = delete;
+
+    void clear() {
+        keys.clear();
+        index.clear();
+        flow_keys.clear();
+        offsets.clear();
+    }
+
+    inline void add(const uint32_t key, const size_t pos) {
+        keys.push_back(key);
+        index.push_back(pos);
+    }
+
+    // Sort what was added and cut it into flows
+    void group() {
+        const size_t n = keys.size();
+        keys_tmp.resize(n);
+        index_tmp.resize(n);
+
+        // Histograms of every digit in one read of the keys
+        count.assign(num_pass * radix, 0);
+        for (size_t i = 0; i < n; ++ i) {
+            for (size_t p = 0; p < num_pass; ++ p) {
+                ++ count[p * radix + ((keys[i] >> (p * radix_bits)) & (radix - 1))];
+            }
+        }
+
+        for (size_t p = 0; p < num_pass; ++ p) {
+            size_t * const p_count = count.data() + p * radix;
+            const uint32_t digit = n > 0 ? (keys[0] >> (p * radix_bits)) & (radix - 1) : 0;
+            // All keys share this digit, the pass would not move anything
+            if (p_count[digit] == n) {
+                continue;
+            }
+            size_t sum = 0;
+            for (size_t d = 0; d < radix; ++ d) {
+                const size_t c = p_count[d];
+                p_count[d] = sum;
+                sum += c;
+            }
+            for (size_t i = 0; i < n; ++ i) {
+                const size_t dst = p_count[(keys[i] >> (p * radix_bits)) & (radix - 1)] ++;
+                keys_tmp[dst] = keys[i];
+                index_tmp[dst] = index[i];
+            }
+            keys.swap(keys_tmp);
+            index.swap(index_tmp);
+        }
+
+        flow_keys.clear();
+        offsets.clear();
+        for (size_t i = 0; i < n; ++ i) {
+            if (i == 0 || keys[i] != keys[i - 1]) {
+                flow_keys.push_back(keys[i]);
+                offsets.push_back(i);
+            }
+        }
+        offsets.push_back(n);
+    }
+
+    inline auto num_flow() const -> size_t {
+        return flow_keys.size();
+    }
+
+    inline auto key(const size_t k) const -> uint32_t {
+        return flow_keys[k];
+    }
+
+    inline auto flow(const size_t k) const -> index_range {
+        return {index.data() + offsets[k], offsets[k + 1] - offsets[k]};
+    }
+};
+
+
+// Dense ids of the flow keys of a chunk, in first-seen order, so that keys other than an
+// IPv4 address can be grouped by flow_groups too. Linear probing over a power-of-two
+// table at most half full, with the hash and equality of the key type.
+template<typename K>
+class key_ids final {
+
+private:
+
+    size_t mask = 0;
+    vector<K> slot_keys;
+    // id + 1, 0 for an empty slot
+    vector<uint32_t> slot_ids;
+    vector<K> keys;
+
+public:
+
+    key_ids() = default;
+    key_ids & operator=(const key_ids &) = delete;
+    key_ids(const key_ids &) = delete;
+
+    // Room for max_key distinct keys
+    void reset(const size_t max_key) {
+        size_t cap = 16;
+        while (cap < 2 * max_key) {
+            cap <<= 1;
+        }
+        if (slot_ids.size() < cap) {
+            slot_keys.resize(cap);
+            slot_ids.resize(cap);
+        }
+        mask = cap - 1;
+        fill(slot_ids.begin(), slot_ids.begin() + cap, 0);
+        keys.clear();
+    }
+
+    auto get_id(const K & key) -> uint32_t {
+        for (size_t s = flow_key_hash()(key) & mask; ; s = (s + 1) & mask) {
+            if (slot_ids[s] == 0) {
+                slot_keys[s] = key;
+                keys.push_back(key);
+                slot_ids[s] = keys.size();
+                return keys.size() - 1;
+            }
+            if (flow_key_equal()(slot_keys[s], key)) {
+                return slot_ids[s] - 1;
+            }
+        }
+    }
+
+    inline auto get_key(const uint32_t id) const -> const K & {
+        return keys[id];
+    }
+};
+
+}
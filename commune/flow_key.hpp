@@ -0,0 +1,156 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "packet_info.hpp"
+#include "packet_store.hpp"
+
+namespace Whisper
+{
+
+enum flow_key_t : uint8_t {
+    FLOW_KEY_SRC_ADDR   = 0,
+    FLOW_KEY_ADDR_PAIR  = 1,
+    FLOW_KEY_TUPLE4     = 2,
+};
+
+// Analyzer JSON "flow_key" values
+constexpr const char* flow_key_names[] = {
+    "src_addr", "addr_pair", "tuple4"
+};
+
+
+// Hash of every flow key type, each written out for its fields, so no key pays
+// for a generic tuple hash. Addresses are mixed as whole 64-bit words.
+struct flow_key_hash final {
+
+    static inline auto mix(const uint64_t x) -> uint64_t {
+        uint64_t h = x * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 32;
+        h *= 0xD6E8FEB86659FD93ULL;
+        return h ^ (h >> 32);
+    }
+
+    static inline auto fold(const pkt_addr6_t x) -> uint64_t {
+        return static_cast<uint64_t>(x) ^ mix(static_cast<uint64_t>(x >> 64));
+    }
+
+    inline auto operator()(const pkt_addr4_t k) const -> uint64_t {
+        return mix(k);
+    }
+
+    inline auto operator()(const pkt_addr6_t k) const -> uint64_t {
+        return mix(fold(k));
+    }
+
+    inline auto operator()(const tuple2_conn4 & k) const -> uint64_t {
+        return mix(static_cast<uint64_t>(get<0>(k)) << 32 | get<1>(k));
+    }
+
+    inline auto operator()(const tuple2_conn6 & k) const -> uint64_t {
+        return mix(fold(get<0>(k)) ^ mix(fold(get<1>(k))));
+    }
+
+    inline auto operator()(const tuple4_conn4 & k) const -> uint64_t {
+        const uint64_t ports = static_cast<uint64_t>(get<2>(k)) << 16 | get<3>(k);
+        return mix((static_cast<uint64_t>(get<0>(k)) << 32 | get<1>(k)) ^ mix(ports));
+    }
+
+    inline auto operator()(const tuple4_conn6 & k) const -> uint64_t {
+        const uint64_t ports = static_cast<uint64_t>(get<2>(k)) << 16 | get<3>(k);
+        return mix(fold(get<0>(k)) ^ mix(fold(get<1>(k)) ^ mix(ports)));
+    }
+};
+
+
+struct flow_key_equal final {
+
+    inline auto operator()(const pkt_addr4_t a, const pkt_addr4_t b) const -> bool {
+        return a == b;
+    }
+
+    inline auto operator()(const pkt_addr6_t a, const pkt_addr6_t b) const -> bool {
+        return a == b;
+    }
+
+    template<typename Addr>
+    inline auto operator()(const tuple<Addr, Addr> & a, const tuple<Addr, Addr> & b) const -> bool {
+        return get<0>(a) == get<0>(b) && get<1>(a) == get<1>(b);
+    }
+
+    template<typename Addr>
+    inline auto operator()(const tuple<Addr, Addr, pkt_port_t, pkt_port_t> & a,
+                           const tuple<Addr, Addr, pkt_port_t, pkt_port_t> & b) const -> bool {
+        return get<0>(a) == get<0>(b) && get<1>(a) == get<1>(b) &&
+            get<2>(a) == get<2>(b) && get<3>(a) == get<3>(b);
+    }
+};
+
+
+// Flow key written to the results, IPv6 addresses as decimal strings as in the traces
+inline auto flow_key_json(const pkt_addr4_t k) -> json {
+    return k;
+}
+
+inline auto flow_key_json(const pkt_addr6_t k) -> json {
+    return uint128_2_string(k);
+}
+
+template<typename Addr>
+inline auto flow_key_json(const tuple<Addr, Addr> & k) -> json {
+    return json::array({flow_key_json(get<0>(k)), flow_key_json(get<1>(k))});
+}
+
+template<typename Addr>
+inline auto flow_key_json(const tuple<Addr, Addr, pkt_port_t, pkt_port_t> & k) -> json {
+    return json::array({flow_key_json(get<0>(k)), flow_key_json(get<1>(k)), get<2>(k), get<3>(k)});
+}
+
+
+// Flow key policies, the key of an IPv4 and of an IPv6 packet of a packet_store.
+// IPv4 addresses are in host order, as the analyzer always reported them.
+
+// One flow per host
+struct src_addr_key final {
+    using key4_t = pkt_addr4_t;
+    using key6_t = pkt_addr6_t;
+
+    static inline auto key4(const packet_store & store, const size_t i) -> key4_t {
+        return ntohl(store.src_addr[i]);
+    }
+
+    static inline auto key6(const packet_store & store, const size_t i) -> key6_t {
+        return store.src_addr6[store.src_addr[i]];
+    }
+};
+
+// One flow per (source, destination) host pair
+struct addr_pair_key final {
+    using key4_t = tuple2_conn4;
+    using key6_t = tuple2_conn6;
+
+    static inline auto key4(const packet_store & store, const size_t i) -> key4_t {
+        return key4_t{ntohl(store.src_addr[i]), ntohl(store.dst_addr[i])};
+    }
+
+    static inline auto key6(const packet_store & store, const size_t i) -> key6_t {
+        return key6_t{store.src_addr6[store.src_addr[i]], store.dst_addr6[store.dst_addr[i]]};
+    }
+};
+
+// One flow per connection
+struct tuple4_key final {
+    using key4_t = tuple4_conn4;
+    using key6_t = tuple4_conn6;
+
+    static inline auto key4(const packet_store & store, const size_t i) -> key4_t {
+        return key4_t{ntohl(store.src_addr[i]), ntohl(store.dst_addr[i]), store.src_port[i], store.dst_port[i]};
+    }
+
+    static inline auto key6(const packet_store & store, const size_t i) -> key6_t {
+        return key6_t{store.src_addr6[store.src_addr[i]], store.dst_addr6[store.dst_addr[i]],
+            store.src_port[i], store.dst_port[i]};
+    }
+};
+
+}
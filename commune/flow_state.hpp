@@ -0,0 +1,54 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+
+namespace Whisper
+{
+
+// Per-address analysis state carried from one chunk to the next, so that a flow is
+// transformed and scored as one sequence whatever the chunk and batch boundaries.
+struct flow_state final {
+
+    // Input side
+    double_t first_ts = 0;
+    double_t last_ts = 0;
+    size_t num_pkt = 0;
+    // Left reflect padding applied, frames are being cut from samples
+    bool started = false;
+    // Samples from head on are not covered by a cut frame yet, padded once started.
+    // The consumed ones are dropped once they make up half of the vector.
+    vector<double_t> samples;
+    size_t head = 0;
+
+    // Test side: frames seen while testing, the open window and the last full one,
+    // which only counts once a later frame exists
+    size_t test_frame = 0;
+    size_t win_frame = 0;
+    vector<double_t> win_sum;
+    vector<double_t> total_sum;
+    vector<double_t> pending;
+    bool has_pending = false;
+    // Farthest confirmed window so far
+    pair<double_t, int> score{0, -1};
+    // The same over the windows kept while the learner trains, shared with the kept
+    // parts that fill it in once the centers land, see the analyzer
+    shared_ptr<pair<double_t, int> > p_late;
+
+    // Some packets arrived while testing, only such flows get a record
+    bool tested = false;
+    // Indices of the packets not in a record yet, bounded by max_flow_packets plus one
+    // chunk, see the analyzer
+    vector<size_t> pkt_indices;
+    // Part of the packets already went out in an earlier record
+    bool split = false;
+    bool is_malicious = false;
+
+    // Heap memory of the vectors above, what the flow table adds to its own footprint
+    inline auto heap_bytes() const -> size_t {
+        return (samples.capacity() + win_sum.capacity() + total_sum.capacity() + pending.capacity()) * 
+            sizeof(double_t) + pkt_indices.capacity() * sizeof(size_t);
+    }
+};
+
+}
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "packet_info.hpp"
+#include "flow_key.hpp"
+
+namespace Whisper
+{
+
+// Fixed-capacity table from a flow key (see flow_key.hpp) to V, for state that must
+// stay bounded whatever the number of distinct flows. A key lives in one of two
+// candidate buckets, each one cache line of keys, so a lookup touches at most two lines
+// and never probes further. Values are preallocated next to each other, slot = bucket * num_way + way,
+// the table itself does not grow once built. Whatever a value holds on the heap is up to V,
+// it is read through V::heap_bytes() when the value is unpinned, so memory_bytes() is the
+// sum as of the last unpin_all() and costs nothing.
+//
+// When both buckets of a new key are full, a victim is chosen by a clock over their ways:
+// a way touched since the hand last passed gets a second chance. Ways touched since the
+// last unpin_all() are never chosen, so the values handed out for one batch stay valid;
+// insert() fails when no way is left, and the caller handles that key on its own.
+//
+// A second hand goes round the whole table, a bounded number of slots per call: expire()
+// drops the values due on its way, trim() the ones not touched since it last passed,
+// until the table fits a byte budget.
+template<typename V, typename K = pkt_addr4_t>
+class flow_table final {
+
+public:
+
+    // As many keys as fit beside 8 bytes of way masks, 14 IPv4 or 3 IPv6 addresses
+    static constexpr size_t num_way = (64 - 8) / sizeof(K);
+    static_assert(num_way >= 1 && num_way <= 16, "flow_table key does not fit a bucket");
+
+    struct counters {
+        size_t inserted = 0;
+        size_t evicted = 0;
+        size_t expired = 0;
+        size_t overflowed = 0;
+        size_t trimmed = 0;
+    };
+
+private:
+
+    struct alignas(64) bucket {
+        K keys[num_way];
+        uint16_t used = 0;
+        // Touched since the clock hand last passed
+        uint16_t ref = 0;
+        // Touched since the last unpin_all()
+        uint16_t pinned = 0;
+        uint8_t hand = 0;
+    };
+    static_assert(sizeof(bucket) == 64, "flow_table bucket should fill one cache line");
+
+    const size_t num_bucket;
+    vector<bucket> buckets;
+    vector<V> values;
+    // Heap bytes of each value as of its last unpin, and their sum
+    vector<size_t> heap;
+    size_t heap_total = 0;
+    // Slots pinned since the last unpin_all()
+    vector<size_t> touched;
+    // Slot of the table-wide hand
+    size_t sweep_hand = 0;
+
+    size_t num_entry = 0;
+    counters stat;
+
+    // Two distinct buckets of a key, mapped by multiply-shift so num_bucket needs no rounding
+    inline auto candidates(const K & key) const -> pair<size_t, size_t> {
+        const uint64_t h = flow_key_hash()(key);
+        const size_t b1 = ((h & 0xFFFFFFFFULL) * num_bucket) >> 32;
+        size_t b2 = ((h >> 32) * num_bucket) >> 32;
+        if (b2 == b1) {
+            b2 = (b1 + 1) % num_bucket;
+        }
+        return {b1, b2};
+    }
+
+    static inline auto locate(const bucket & b, const K & key) -> int {
+        for (size_t w = 0; w < num_way; ++ w) {
+            if ((b.used >> w & 1) && flow_key_equal()(b.keys[w], key)) {
+                return w;
+            }
+        }
+        return -1;
+    }
+
+    static inline auto free_way(const bucket & b) -> int {
+        for (size_t w = 0; w < num_way; ++ w) {
+            if (!(b.used >> w & 1)) {
+                return w;
+            }
+        }
+        return -1;
+    }
+
+    // One sweep of the hand over the ways of b, -1 when every way is pinned
+    static inline auto clock_victim(bucket & b) -> int {
+        for (size_t step = 0; step < 2 * num_way; ++ step) {
+            const size_t w = b.hand;
+            b.hand = (b.hand + 1) % num_way;
+            if (b.pinned >> w & 1) {
+                continue;
+            }
+            if (b.ref >> w & 1) {
+                b.ref &= ~(1u << w);
+                continue;
+            }
+            return w;
+        }
+        return -1;
+    }
+
+    inline auto touch(const size_t b, const size_t w) -> V * {
+        buckets[b].ref |= 1u << w;
+        if (!(buckets[b].pinned >> w & 1)) {
+            buckets[b].pinned |= 1u << w;
+            touched.push_back(b * num_way + w);
+        }
+        return &values[b * num_way + w];
+    }
+
+    inline void drop(const size_t b, const size_t w) {
+        const uint16_t keep = ~(1u << w);
+        const size_t slot = b * num_way + w;
+        buckets[b].used &= keep;
+        buckets[b].ref &= keep;
+        buckets[b].pinned &= keep;
+        values[slot] = V();
+        heap_total -= heap[slot];
+        heap[slot] = 0;
+        -- num_entry;
+    }
+
+    // Moves the table-wide hand over at most max_step slots, on_slot(b, w) sees each one
+    // in use and not pinned, and returns false to stop the hand there
+    template<typename F>
+    void advance_sweep(const size_t max_step, F && on_slot) {
+        const size_t num_slot = values.size();
+        for (size_t step = 0; step < max_step; ++ step) {
+            const size_t slot = sweep_hand;
+            sweep_hand = (sweep_hand + 1) % num_slot;
+            const size_t b = slot / num_way;
+            const size_t w = slot % num_way;
+            if (!(buckets[b].used >> w & 1) || (buckets[b].pinned >> w & 1)) {
+                continue;
+            }
+            if (!on_slot(b, w)) {
+                return;
+            }
+        }
+    }
+
+public:
+
+    // Room for at least max_entry keys
+    explicit flow_table(const size_t max_entry):
+        num_bucket(max<size_t>(2, (max_entry + num_way - 1) / num_way)),
+        buckets(num_bucket), values(num_bucket * num_way), heap(num_bucket * num_way) {}
+
+    flow_table & operator=(const flow_table &) = delete;
+    flow_table(const flow_table &) = delete;
+
+    inline auto size() const -> size_t {
+        return num_entry;
+    }
+
+    inline auto capacity() const -> size_t {
+        return num_bucket * num_way;
+    }
+
+    // Table footprint, whatever the values hold on the heap aside
+    inline auto fixed_bytes() const -> size_t {
+        return num_bucket * sizeof(bucket) + values.size() * (sizeof(V) + sizeof(size_t));
+    }
+
+    // Table footprint plus the heap memory of the values as of the last unpin_all()
+    inline auto memory_bytes() const -> size_t {
+        return fixed_bytes() + heap_total;
+    }
+
+    inline auto get_counters() const -> const counters & {
+        return stat;
+    }
+
+    auto find(const K & key) -> V * {
+        const auto _bs = candidates(key);
+        for (const size_t b : {_bs.first, _bs.second}) {
+            const int w = locate(buckets[b], key);
+            if (w >= 0) {
+                return touch(b, w);
+            }
+        }
+        return nullptr;
+    }
+
+    // Value of key, default-constructed when new. on_evict(key, V &) sees the value
+    // a new key displaces before it is reset. nullptr when both buckets are pinned.
+    template<typename F>
+    auto insert(const K & key, F && on_evict) -> V * {
+        V * const p_found = find(key);
+        if (p_found != nullptr) {
+            return p_found;
+        }
+
+        const auto _bs = candidates(key);
+        bucket & b1 = buckets[_bs.first];
+        bucket & b2 = buckets[_bs.second];
+        size_t b = _bs.first;
+        int w = free_way(b1);
+        if (w < 0) {
+            b = _bs.second;
+            w = free_way(b2);
+        }
+        if (w < 0) {
+            b = _bs.first;
+            w = clock_victim(b1);
+            if (w < 0) {
+                b = _bs.second;
+                w = clock_victim(b2);
+            }
+            if (w < 0) {
+                ++ stat.overflowed;
+                return nullptr;
+            }
+            on_evict(buckets[b].keys[w], values[b * num_way + w]);
+            drop(b, w);
+            ++ stat.evicted;
+        }
+
+        buckets[b].keys[w] = key;
+        buckets[b].used |= 1u << w;
+        ++ num_entry;
+        ++ stat.inserted;
+        return touch(b, w);
+    }
+
+    // Removes the keys whose value satisfies pred among the next max_step slots of the hand,
+    // after on_expire(key, V &). Values pinned for the batch are left for a later pass.
+    template<typename P, typename F>
+    void expire(P && pred, F && on_expire, const size_t max_step) {
+        advance_sweep(max_step, [&] (const size_t b, const size_t w) -> bool {
+            if (pred(values[b * num_way + w])) {
+                on_expire(buckets[b].keys[w], values[b * num_way + w]);
+                drop(b, w);
+                ++ stat.expired;
+            }
+            return true;
+        });
+    }
+
+    // Evicts keys until memory_bytes() is within max_bytes, after on_evict(key, V &).
+    // A key touched since the hand last passed gets a second chance, pinned ones stay.
+    template<typename F>
+    void trim(const size_t max_bytes, F && on_evict) {
+        if (memory_bytes() <= max_bytes) {
+            return;
+        }
+        // Two rounds clear every reference bit on the way
+        advance_sweep(2 * values.size(), [&] (const size_t b, const size_t w) -> bool {
+            if (buckets[b].ref >> w & 1) {
+                buckets[b].ref &= ~(1u << w);
+                return true;
+            }
+            on_evict(buckets[b].keys[w], values[b * num_way + w]);
+            drop(b, w);
+            ++ stat.trimmed;
+            return memory_bytes() > max_bytes;
+        });
+    }
+
+    template<typename F>
+    void for_each(F && fn) {
+        for (size_t b = 0; b < num_bucket; ++ b) {
+            for (size_t w = 0; w < num_way; ++ w) {
+                if (buckets[b].used >> w & 1) {
+                    fn(buckets[b].keys[w], values[b * num_way + w]);
+                }
+            }
+        }
+    }
+
+    // End of a batch, its values may be evicted again. Their heap memory is read here,
+    // the caller has changed them through the pointers handed out.
+    void unpin_all() {
+        for (const size_t slot : touched) {
+            const size_t b = slot / num_way;
+            const size_t w = slot % num_way;
+            if (!(buckets[b].pinned >> w & 1)) {
+                continue;
+            }
+            buckets[b].pinned &= ~(1u << w);
+            const size_t bytes = values[slot].heap_bytes();
+            heap_total += bytes - heap[slot];
+            heap[slot] = bytes;
+        }
+        touched.clear();
+    }
+
+    void clear() {
+        for (size_t b = 0; b < num_bucket; ++ b) {
+            for (size_t w = 0; w < num_way; ++ w) {
+                if (buckets[b].used >> w & 1) {
+                    values[b * num_way + w] = V();
+                }
+                heap[b * num_way + w] = 0;
+            }
+            buckets[b] = bucket();
+        }
+        heap_total = 0;
+        touched.clear();
+        sweep_hand = 0;
+        num_entry = 0;
+        stat = counters();
+    }
+};
+
+}
@@ -2,14 +2,22 @@
 
 #include "../common.hpp"
 #include "./analyzerWorker.hpp"
+#include "./worker_pool.hpp"
+#include "./mini_batch_kmeans.hpp"
 
 #include <mlpack/core.hpp>
 #include <mlpack/methods/kmeans/kmeans.hpp>
+#include <mlpack/methods/kmeans/kmeans_plus_plus_initialization.hpp>
+#include <mlpack/methods/kmeans/elkan_kmeans.hpp>
+#include <mlpack/methods/kmeans/hamerly_kmeans.hpp>
+#include <mlpack/methods/kmeans/dual_tree_kmeans.hpp>
 
 
 #include <time.h>
 #include <unistd.h>
 #include <semaphore.h>
+#include <mutex>
+#include <atomic>
 
 
 namespace Whisper {
@@ -19,6 +27,30 @@ class AnalyzerWorkerThread;
 class whisper_detector;
 
 
+enum kmeans_algo_t : uint8_t {
+    KMEANS_NAIVE        = 0,
+    KMEANS_ELKAN        = 1,
+    KMEANS_HAMERLY      = 2,
+    KMEANS_DUAL_TREE    = 3,
+    KMEANS_MINI_BATCH   = 4,
+};
+
+// Learner JSON "algorithm" values, the first four are the mlpack Lloyd iterations
+constexpr const char* kmeans_algo_names[] = {
+    "naive", "elkan", "hamerly", "dual_tree", "mini_batch"
+};
+
+enum kmeans_init_t : uint8_t {
+    KMEANS_INIT_RANDOM      = 0,
+    KMEANS_INIT_PLUS_PLUS   = 1,
+};
+
+// Learner JSON "init" values, random samples or k-means++ seeding
+constexpr const char* kmeans_init_names[] = {
+    "random", "kmeans++"
+};
+
+
 struct LearnerConfigParam final {
     // Number of required trainning data
     size_t num_train_data = 2000;
@@ -35,9 +67,28 @@ struct LearnerConfigParam final {
     bool load_result = false;
     string load_result_file = "";
 
+    kmeans_algo_t algorithm = KMEANS_NAIVE;
+    kmeans_init_t init = KMEANS_INIT_RANDOM;
+
+    // Lloyd iterations, or batches for mini-batch
+    size_t max_iterations = 1000;
+    // Samples per mini-batch iteration
+    size_t batch_size = 1024;
+
+    // Seed of the initial centers, 0 for a different one on every run
+    uint32_t seed = 0;
+
     auto inline display_params() const -> void {
         printf("[Whisper Leaner Configuration]\n");
         printf("Record required for training: %ld, K value for Kmeans: %ld\n", num_train_data, val_K);
+        printf("Kmeans algorithm: %s, init: %s, max iterations: %ld\n",
+               kmeans_algo_names[algorithm], kmeans_init_names[init], max_iterations);
+        if (algorithm == KMEANS_MINI_BATCH) {
+            printf("Mini-batch size: %ld\n", batch_size);
+        }
+        if (seed != 0) {
+            printf("Random seed: %u\n", seed);
+        }
         if (save_result) {
             printf("Save training result to: %s\n", save_result_file.c_str());
         }
@@ -61,10 +112,13 @@ class KMeansLearner final {
 
 private:
 
-    using feature_t = vector<double_t>;
-
-    // Dataset collected from AnalyzeWorker
-    vector<vector<double_t> > train_set;
+    // Dataset collected from AnalyzeWorker, column-major with one train_dim-sized column
+    // per record, so mlpack clusters it in place. Space for num_train_data records is
+    // reserved with the first one. Records added in float are kept in train_set32.
+    vector<double_t> train_set;
+    vector<float> train_set32;
+    size_t train_dim = 0;
+    size_t num_train = 0;
     
     // Mutual exclution lock for trainSet
     mutable sem_t data_sema;
@@ -84,27 +138,35 @@ private:
         sem_post(&learn_sema);
     }
 
-    // Clustering centers
-    vector<feature_t> train_result;
+    // Clustering centers, train_dim x val_K, one center per column
+    arma::mat train_result;
+    // train_result as published to the analyzers once training ends, swapped atomically
+    shared_ptr<const arma::mat> p_centers;
+
+    // Runs the clustering, started by start_train()
+    thread train_thread;
 
     shared_ptr<LearnerConfigParam> p_learner_config;
 
+    // Shared worker pool, may be null
+    shared_ptr<worker_pool> p_worker_pool;
+
     auto save_result_file() const -> bool {
         if (p_learner_config->verbose) {
             LOGF("Save centers to file: %s.", p_learner_config->save_result_file.c_str());
         }
         assert(p_learner_config->save_result);
         try {
-            ofstream fs(p_learner_config->load_result_file);
+            ofstream fs(p_learner_config->save_result_file);
             if (!fs.good()) {
                 throw logic_error("Open target file failed.");
             }
             json _j;
 
-            for (size_t i = 0; i < train_result.size(); i ++) {
+            for (size_t i = 0; i < train_result.n_cols; i ++) {
                 json __j;
-                for (size_t j = 0; j < train_result[0].size(); j ++) {
-                    __j.push_back(train_result[i][j]);
+                for (size_t j = 0; j < train_result.n_rows; j ++) {
+                    __j.push_back(train_result(j, i));
                 }
                 _j.push_back(__j);
             }
@@ -137,10 +199,10 @@ private:
             if (centers.size() != p_learner_config->val_K) {
                 throw logic_error("Cluster centers number mismatch.");
             }
+            train_result.set_size(centers[0].size(), centers.size());
             for (size_t i = 0; i < centers.size(); i ++) {
-                train_result.push_back({});
                 for (size_t j = 0; j < centers[0].size(); j ++) {
-                    train_result[i].push_back(centers[i][j]);
+                    train_result(j, i) = centers[i][j];
                 }
             }
         } catch (exception & e) {
@@ -151,17 +213,115 @@ private:
         if (p_learner_config->verbose) {
             LOGF("Load result from file success.");
         }
-        start_learn = true;
-        finish_learn = true;
         return true;
     }
 
+    // Centers of the finished training to the analyzers
+    void publish_result() {
+        atomic_store(&p_centers, make_shared<const arma::mat>(train_result));
+        finish_learn = true;
+    }
+
+    template<typename Init, template<class, class> class Lloyd>
+    using mlpack_kmeans = mlpack::kmeans::KMeans<mlpack::metric::EuclideanDistance, Init,
+        mlpack::kmeans::MaxVarianceNewCluster, Lloyd>;
+
+    // Initial centers to train_result. mlpack draws them from one process-wide generator,
+    // so the seeding of concurrent learners (see the sweep) is serialized; with a seed set
+    // the generator is reseeded under the same lock and the draw is repeatable.
+    void seed_mlpack(const arma::mat & dataset) {
+        static mutex seed_mtx;
+        lock_guard<mutex> lock(seed_mtx);
+        if (p_learner_config->seed != 0) {
+            mlpack::math::RandomSeed(p_learner_config->seed);
+        }
+        if (p_learner_config->init == KMEANS_INIT_PLUS_PLUS) {
+            mlpack::kmeans::KMeansPlusPlusInitialization().Cluster(dataset, p_learner_config->val_K, train_result);
+        } else {
+            mlpack::kmeans::SampleInitialization().Cluster(dataset, p_learner_config->val_K, train_result);
+        }
+    }
+
+    // mlpack KMeans with the Lloyd iteration Lloyd from the centers in train_result.
+    // The iterations draw no random numbers and run concurrently with other learners.
+    template<template<class, class> class Lloyd>
+    void cluster_mlpack(const arma::mat & dataset) {
+        mlpack_kmeans<mlpack::kmeans::SampleInitialization, Lloyd> k(p_learner_config->max_iterations);
+        k.Cluster(dataset, p_learner_config->val_K, train_result, true);
+    }
+
+    template<typename T>
+    inline auto get_train_set() -> vector<T> & {
+        if constexpr (is_same<T, float>::value) {
+            return train_set32;
+        } else {
+            return train_set;
+        }
+    }
+
+    // mlpack clusters a double matrix, a float training set is widened for the training only
+    auto train_matrix() -> arma::mat {
+        if (train_set32.empty()) {
+            return arma::mat(train_set.data(), train_dim, num_train, false, true);
+        }
+        arma::mat dataset(train_dim, num_train);
+        copy(train_set32.begin(), train_set32.end(), dataset.memptr());
+        return dataset;
+    }
+
+    template<typename T>
+    auto cluster_mini_batch(const T * const p_data) -> size_t {
+        mini_batch_kmeans<T> _kmeans(p_data, train_dim, num_train, p_worker_pool.get(), p_learner_config->seed);
+        return _kmeans.cluster(p_learner_config->val_K, p_learner_config->init == KMEANS_INIT_PLUS_PLUS,
+                               p_learner_config->batch_size, p_learner_config->max_iterations, train_result);
+    }
+
+    // Body of the training thread. No record is added once training started,
+    // the training set is clustered where it is.
+    void train() {
+        if (p_learner_config->algorithm == KMEANS_MINI_BATCH) {
+            const size_t _num_iter = train_set32.empty() ? 
+                cluster_mini_batch(train_set.data()) : cluster_mini_batch(train_set32.data());
+            if (p_learner_config->verbose) {
+                LOGF("Learner: Mini-batch kmeans ran %ld iterations.", _num_iter);
+            }
+        } else {
+            const arma::mat dataset = train_matrix();
+            seed_mlpack(dataset);
+            switch (p_learner_config->algorithm) {
+                case KMEANS_ELKAN:
+                    cluster_mlpack<mlpack::kmeans::ElkanKMeans>(dataset);
+                    break;
+                case KMEANS_HAMERLY:
+                    cluster_mlpack<mlpack::kmeans::HamerlyKMeans>(dataset);
+                    break;
+                case KMEANS_DUAL_TREE:
+                    cluster_mlpack<mlpack::kmeans::DefaultDualTreeKMeans>(dataset);
+                    break;
+                default:
+                    cluster_mlpack<mlpack::kmeans::NaiveKMeans>(dataset);
+                    break;
+            }
+        }
+
+        if (p_learner_config->save_result) {
+            if (!save_result_file()) {
+                FATAL_ERROR("Learner save result to file failed.");
+            }
+        }
+        publish_result();
+
+        if(p_learner_config->verbose) {
+            LOGF("Learner: Finsih training");
+        }
+    }
+
 public:
     
     // Start the learning process
-    volatile bool start_learn = false;
-    // Finish the learning process
-    volatile bool finish_learn = false;
+    atomic<bool> start_learn{false};
+    // Finish the learning process, the centers are published
+    atomic<bool> finish_learn{false};
     
     // Default constructor
     KMeansLearner() {
@@ -170,7 +330,9 @@ public:
     }
 
     // Default deconstructor
-    ~KMeansLearner() {}
+    ~KMeansLearner() {
+        wait_train();
+    }
     KMeansLearner & operator=(const KMeansLearner &) const = delete;
     KMeansLearner(const KMeansLearner &) = delete;
 
@@ -180,75 +342,77 @@ public:
         sem_init(&learn_sema, 0, 1);
     }
 
-    // Add single recored to the training dataset
-    void add_train_data(feature_t & ve) {
-        train_set.push_back(ve);
+    void inline set_worker_pool(const shared_ptr<worker_pool> _p) {
+        p_worker_pool = _p;
     }
 
-    // Add a batch of data to the training dataset
-    void add_train_data(vector<feature_t> & vve) {
-        train_set.insert(train_set.end(), vve.begin(), vve.end());
+    // Add num records of dim values, one after the other at p_data, to the training dataset.
+    // Records that come after the training started are dropped. All records of a learner
+    // come in the same precision, double or float.
+    template<typename T>
+    void add_train_data(const T * const p_data, const size_t num, const size_t dim) {
+        acquire_semaphore_data();
+        if (!start_learn) {
+            auto & _set = get_train_set<T>();
+            // Training starts with the batch that passes num_train_data, batches are alike
+            if (_set.empty()) {
+                train_dim = dim;
+                _set.reserve((p_learner_config->num_train_data + num) * dim);
+            }
+            _set.insert(_set.end(), p_data, p_data + num * dim);
+            assert(dim == train_dim && (train_set.empty() || train_set32.empty()));
+            num_train += num;
+        }
+        release_semaphore_data();
     }
 
-    // Start the training process.
+    // Start the training process, in the background: the clustering runs on its own
+    // thread on the records collected so far, and finish_learn turns true once the centers
+    // are published, see get_centers(). Loading the result from a file is done at once.
     // The training process can be started by only one AnalyzeWorker.
     void start_train() {
         if (p_learner_config == nullptr) {
             FATAL_ERROR("Configuration for learner not found.");
         }
 
-        start_learn = true;
-        if(p_learner_config->verbose) {
-            if (!p_learner_config->load_result) {
-                LOGF("Learner: Start training, %ld records.", train_set.size());
-            }
+        acquire_semaphore_learn();
+        if (start_learn) {
+            release_semaphore_learn();
+            return;
         }
+        start_learn = true;
 
         if (p_learner_config->load_result) {
             if (!load_result_file()) {
                 FATAL_ERROR("Learner Load result from file failed.");
-            } else {
-                return;
             }
+            publish_result();
+            release_semaphore_learn();
+            return;
         }
 
-        // Transform the std::vector representation to arma::matrix
-        size_t x_len = train_set.size();
-        size_t y_len = train_set[0].size();
-        arma::mat dataset(x_len, y_len, arma::fill::randu);
-        for (size_t i = 0; i < x_len; i ++) {
-            for (size_t j = 0; j < y_len; j ++) {
-                dataset(i, j) = train_set[i][j];
-            }
-        }
-        dataset = dataset.t();
-
-        // Call the mlpack KMeans implementation
-        arma::mat centroids;
-        arma::Row<size_t> assignments;
-        mlpack::kmeans::KMeans<> k;
-        k.Cluster(dataset, p_learner_config->val_K, assignments, centroids);
-        
-        // Transform the arma::matrix to std::vector type
-        centroids = centroids.t();
-        for (size_t i = 0; i < centroids.n_rows; i ++) {
-            vector<double_t> ve;
-            for (size_t j = 0; j < centroids.n_cols; j ++) {
-                ve.push_back(centroids(i, j));
-            }
-            train_result.push_back(ve);
+        // Additions check start_learn under the same lock, the set is final from here
+        acquire_semaphore_data();
+        release_semaphore_data();
+        if(p_learner_config->verbose) {
+            LOGF("Learner: Start training, %ld records.", num_train);
         }
-        finish_learn = true;
+        train_thread = thread(&KMeansLearner::train, this);
+        release_semaphore_learn();
+    }
 
-        if (p_learner_config->save_result) {
-            if (!save_result_file()) {
-                FATAL_ERROR("Learner save result to file failed.");
-            }
+    // Blocks until a training in progress is over
+    void wait_train() {
+        acquire_semaphore_learn();
+        if (train_thread.joinable()) {
+            train_thread.join();
         }
+        release_semaphore_learn();
+    }
 
-        if(p_learner_config->verbose) {
-            LOGF("Learner: Finsih training");
-        }
+    // Published centers, one per column, nullptr before training ends
+    auto inline get_centers() const -> shared_ptr<const arma::mat> {
+        return atomic_load(&p_centers);
     }
 
     // Training data is enough or not
@@ -259,7 +423,7 @@ public:
         if (p_learner_config->load_result) {
             return true;
         }
-        return train_set.size() > p_learner_config->num_train_data;
+        return num_train > p_learner_config->num_train_data;
     }
 
 
@@ -296,6 +460,43 @@ public:
         p_learner_config->verbose = 
             static_cast<decltype(p_learner_config->verbose)>(jin["verbose"]);
 
+        if (jin.count("algorithm")) {
+            const string _algo = jin["algorithm"];
+            const auto _end = kmeans_algo_names + sizeof(kmeans_algo_names) / sizeof(kmeans_algo_names[0]);
+            const auto _it = find(kmeans_algo_names, _end, _algo);
+            if (_it == _end) {
+                WARNF("Invalid kmeans algorithm: %s.", _algo.c_str());
+                return false;
+            }
+            p_learner_config->algorithm = static_cast<kmeans_algo_t>(_it - kmeans_algo_names);
+        }
+        if (jin.count("init")) {
+            const string _init = jin["init"];
+            const auto _end = kmeans_init_names + sizeof(kmeans_init_names) / sizeof(kmeans_init_names[0]);
+            const auto _it = find(kmeans_init_names, _end, _init);
+            if (_it == _end) {
+                WARNF("Invalid kmeans init: %s.", _init.c_str());
+                return false;
+            }
+            p_learner_config->init = static_cast<kmeans_init_t>(_it - kmeans_init_names);
+        }
+        if (jin.count("max_iterations")) {
+            p_learner_config->max_iterations = 
+                static_cast<decltype(p_learner_config->max_iterations)>(jin["max_iterations"]);
+        }
+        if (jin.count("batch_size")) {
+            p_learner_config->batch_size = 
+                static_cast<decltype(p_learner_config->batch_size)>(jin["batch_size"]);
+            if (p_learner_config->batch_size == 0) {
+                WARNF("Invalid mini-batch size.");
+                return false;
+            }
+        }
+        if (jin.count("seed")) {
+            p_learner_config->seed = 
+                static_cast<decltype(p_learner_config->seed)>(jin["seed"]);
+        }
+
         return true;
     }
 };
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "worker_pool.hpp"
+
+#include <mlpack/core.hpp>
+#include <random>
+
+namespace Whisper
+{
+
+// Mini-batch k-means (Sculley, Web-scale k-means clustering, 2010) over a column-major
+// dim x num training set of T. Each iteration assigns a random batch of samples to their nearest
+// centers on the worker pool, then moves every center to the mean of all the samples it
+// was given so far, so its step size decays as 1 / count.
+//
+// Seeding draws K samples uniformly, or by k-means++. The generator is only used by the
+// calling thread and sums are taken in a fixed order, so with a fixed seed the centers do
+// not depend on the number of workers. Centers and distances are double for either T.
+template<typename T = double_t>
+class mini_batch_kmeans final {
+
+private:
+
+    // Columns per part of the passes over the whole set
+    static constexpr size_t part_size = 4096;
+
+    static constexpr size_t max_no_improvement = 10;
+
+    const T * const data;
+    const size_t dim;
+    const size_t num;
+
+    worker_pool * const p_pool;
+    mt19937 rng;
+
+    inline auto column(const size_t i) const -> const T * {
+        return data + i * dim;
+    }
+
+    template<typename F>
+    void parallel_for(const size_t begin, const size_t end, F && fn) {
+        if (p_pool != nullptr) {
+            p_pool->parallel_for(begin, end, fn);
+        } else {
+            fn(begin, end);
+        }
+    }
+
+    template<typename A, typename B>
+    inline auto sq_dist(const A * const p_a, const B * const p_b) const -> double_t {
+        double_t sq = 0;
+        #pragma omp simd reduction(+:sq)
+        for (size_t d = 0; d < dim; ++ d) {
+            const double_t diff = static_cast<double_t>(p_a[d]) - p_b[d];
+            sq += diff * diff;
+        }
+        return sq;
+    }
+
+    auto nearest(const arma::mat & centers, const T * const p_x) const -> size_t {
+        size_t best_j = 0;
+        double_t best = sq_dist(p_x, centers.colptr(0));
+        for (size_t j = 1; j < centers.n_cols; ++ j) {
+            const double_t sq = sq_dist(p_x, centers.colptr(j));
+            if (sq < best) {
+                best = sq;
+                best_j = j;
+            }
+        }
+        return best_j;
+    }
+
+    // Mean squared distance of the samples to their mean, the scale of the stop tolerance
+    auto variance() -> double_t {
+        vector<double_t> mean(dim, 0);
+        for (size_t i = 0; i < num; ++ i) {
+            const T * const p_x = column(i);
+            for (size_t d = 0; d < dim; ++ d) {
+                mean[d] += p_x[d];
+            }
+        }
+        for (auto & m : mean) {
+            m /= num;
+        }
+
+        const size_t num_part = (num + part_size - 1) / part_size;
+        vector<double_t> part_sum(num_part, 0);
+        parallel_for(0, num_part, [&] (const size_t _from, const size_t _to) -> void {
+            for (size_t p = _from; p < _to; ++ p) {
+                for (size_t i = p * part_size; i < min(num, (p + 1) * part_size); ++ i) {
+                    part_sum[p] += sq_dist(column(i), mean.data());
+                }
+            }
+        });
+        double_t sum = 0;
+        for (const double_t s : part_sum) {
+            sum += s;
+        }
+        return sum / num;
+    }
+
+    void seed_sample(arma::mat & centers) {
+        uniform_int_distribution<size_t> pick(0, num - 1);
+        for (size_t j = 0; j < centers.n_cols; ++ j) {
+            const T * const p_x = column(pick(rng));
+            copy(p_x, p_x + dim, centers.colptr(j));
+        }
+    }
+
+    // k-means++: every next center is a sample drawn with probability proportional to
+    // its squared distance to the nearest center so far
+    void seed_plus_plus(arma::mat & centers) {
+        vector<double_t> min_sq(num, numeric_limits<double_t>::max());
+        uniform_int_distribution<size_t> pick(0, num - 1);
+        uniform_real_distribution<double_t> unit(0, 1);
+
+        size_t chosen = pick(rng);
+        for (size_t j = 0; j < centers.n_cols; ++ j) {
+            const T * const p_c = column(chosen);
+            copy(p_c, p_c + dim, centers.colptr(j));
+            if (j + 1 == centers.n_cols) {
+                break;
+            }
+
+            parallel_for(0, num, [&] (const size_t _from, const size_t _to) -> void {
+                for (size_t i = _from; i < _to; ++ i) {
+                    min_sq[i] = min(min_sq[i], sq_dist(column(i), p_c));
+                }
+            });
+            double_t total = 0;
+            for (const double_t sq : min_sq) {
+                total += sq;
+            }
+            if (total <= 0) {
+                // Every sample sits on a center already
+                chosen = pick(rng);
+                continue;
+            }
+            const double_t target = unit(rng) * total;
+            double_t acc = 0;
+            chosen = num - 1;
+            for (size_t i = 0; i < num; ++ i) {
+                acc += min_sq[i];
+                if (acc > target) {
+                    chosen = i;
+                    break;
+                }
+            }
+        }
+    }
+
+public:
+
+    // seed 0 seeds from the system
+    mini_batch_kmeans(const T * const _data, const size_t _dim, const size_t _num,
+                      worker_pool * const _p_pool, const uint32_t seed = 0):
+        data(_data), dim(_dim), num(_num), p_pool(_p_pool), rng(seed != 0 ? seed : random_device()()) {}
+
+    mini_batch_kmeans & operator=(const mini_batch_kmeans &) = delete;
+    mini_batch_kmeans(const mini_batch_kmeans &) = delete;
+
+    // K centers, one per column of centers, from at most max_iteration batches. Stops earlier,
+    // though not before one pass worth of samples, when the centers barely move any more or
+    // the smoothed batch inertia did not improve for max_no_improvement batches.
+    // Returns the number of iterations run.
+    auto cluster(const size_t K, const bool plus_plus, size_t batch_size, const size_t max_iteration,
+                 arma::mat & centers) -> size_t {
+        assert(num > 0 && K > 0);
+        centers.set_size(dim, K);
+        if (plus_plus) {
+            seed_plus_plus(centers);
+        } else {
+            seed_sample(centers);
+        }
+
+        batch_size = max<size_t>(1, min(batch_size, num));
+        const size_t min_iteration = (num + batch_size - 1) / batch_size;
+        const double_t tolerance = 1e-8 * variance() * K;
+        // Weight of a batch in the moving average of the inertia
+        const double_t alpha = min(1.0, 2.0 * batch_size / (num + 1));
+
+        uniform_int_distribution<size_t> pick(0, num - 1);
+        vector<size_t> batch(batch_size);
+        vector<size_t> assigned(batch_size);
+        vector<double_t> assigned_sq(batch_size);
+        vector<size_t> count(K, 0);
+        vector<size_t> batch_count(K);
+        arma::mat batch_sum(dim, K);
+
+        double_t ewa_inertia = 0, best_inertia = 0;
+        size_t no_improvement = 0;
+
+        size_t it = 0;
+        while (it < max_iteration) {
+            ++ it;
+            for (auto & i : batch) {
+                i = pick(rng);
+            }
+            parallel_for(0, batch_size, [&] (const size_t _from, const size_t _to) -> void {
+                for (size_t b = _from; b < _to; ++ b) {
+                    const T * const p_x = column(batch[b]);
+                    assigned[b] = nearest(centers, p_x);
+                    assigned_sq[b] = sq_dist(p_x, centers.colptr(assigned[b]));
+                }
+            });
+
+            fill(batch_count.begin(), batch_count.end(), 0);
+            batch_sum.zeros();
+            double_t inertia = 0;
+            for (size_t b = 0; b < batch_size; ++ b) {
+                inertia += assigned_sq[b];
+                const T * const p_x = column(batch[b]);
+                double_t * const p_s = batch_sum.colptr(assigned[b]);
+                for (size_t d = 0; d < dim; ++ d) {
+                    p_s[d] += p_x[d];
+                }
+                ++ batch_count[assigned[b]];
+            }
+
+            double_t shift = 0;
+            for (size_t j = 0; j < K; ++ j) {
+                if (batch_count[j] == 0) {
+                    continue;
+                }
+                count[j] += batch_count[j];
+                const double_t rate = 1.0 / count[j];
+                double_t * const p_c = centers.colptr(j);
+                const double_t * const p_s = batch_sum.colptr(j);
+                for (size_t d = 0; d < dim; ++ d) {
+                    const double_t step = (p_s[d] - batch_count[j] * p_c[d]) * rate;
+                    p_c[d] += step;
+                    shift += step * step;
+                }
+            }
+            inertia /= batch_size;
+            ewa_inertia = it == 1 ? inertia : ewa_inertia * (1 - alpha) + inertia * alpha;
+            if (it == 1 || ewa_inertia < best_inertia) {
+                best_inertia = ewa_inertia;
+                no_improvement = 0;
+            } else {
+                ++ no_improvement;
+            }
+
+            if (it >= min_iteration && (shift <= tolerance || no_improvement >= max_no_improvement)) {
+                break;
+            }
+        }
+        return it;
+    }
+};
+
+}
@@ -45,23 +45,6 @@ struct basic_packet4 final: public basic_packet {
     explicit basic_packet4(const decltype(flow_id) flow_id, 
                            const decltype(ts) ts, const decltype(tp) tp, const decltype(len) len):
                            flow_id(flow_id), basic_packet(ts, tp, len) {}
-    explicit basic_packet4(const string & str) {        
-        stringstream ss(str);
-        int t;
-        ss >> t;
-        assert(t == 4);
-        pkt_addr4_t sIP, dIP;
-        ss >> sIP >> dIP;
-        pkt_port_t sp, dp;
-        ss >> sp >> dp;
-        flow_id = {sIP, dIP, sp, dp};
-        double_t _str_time;
-        ss >> _str_time;
-        // ts = get_time_spec(_str_time / 1e6);
-        ts = _str_time / 1e6;
-        ss >> tp;
-        ss >> len;
-    }
 
     virtual ~basic_packet4() {}
 
@@ -97,23 +80,6 @@ struct basic_packet6 final: public basic_packet {
     explicit basic_packet6(const decltype(flow_id) flow_id, 
                            const decltype(ts) ts, const decltype(tp) tp, const decltype(len) len):
                            flow_id(flow_id), basic_packet(ts, tp, len) {}
-    explicit basic_packet6(const string & str) {
-        
-        stringstream ss(str);
-        int t;
-        ss >> t;
-        assert(t == 6);
-        string sIP, dIP;
-        ss >> sIP >> dIP;
-        pkt_port_t sp, dp;
-        ss >> sp >> dp;
-        flow_id = {string_2_uint128(sIP), string_2_uint128(dIP), sp, dp};
-        double_t _str_time;
-        ss >> _str_time;
-        ts = _str_time / 1e6;
-        ss >> tp;
-        ss >> len;
-    }
 
     virtual ~basic_packet6() {}
 
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "packet_info.hpp"
+
+#include <sys/stat.h>
+#include <climits>
+#include <cstdlib>
+
+namespace Whisper
+{
+
+// Identity of an input file of a cache: its resolved path, size and modification time.
+// A missing file has size and time 0, so a trace parsed without labels matches itself.
+struct packet_cache_stamp final {
+    uint64_t path_hash;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+
+    static auto of_file(const string & path) -> packet_cache_stamp {
+        packet_cache_stamp _st{};
+        char _real[PATH_MAX];
+        const string _path = realpath(path.c_str(), _real) != nullptr ? string(_real) : path;
+        // FNV-1a
+        _st.path_hash = 0xCBF29CE484222325ULL;
+        for (const char c : _path) {
+            _st.path_hash = (_st.path_hash ^ static_cast<uint8_t>(c)) * 0x100000001B3ULL;
+        }
+        struct stat _fs;
+        if (!path.empty() && stat(path.c_str(), &_fs) == 0) {
+            _st.size = _fs.st_size;
+            _st.mtime_sec = _fs.st_mtim.tv_sec;
+            _st.mtime_nsec = _fs.st_mtim.tv_nsec;
+        }
+        return _st;
+    }
+
+    inline auto operator==(const packet_cache_stamp & b) const -> bool {
+        return path_hash == b.path_hash && size == b.size && 
+            mtime_sec == b.mtime_sec && mtime_nsec == b.mtime_nsec;
+    }
+};
+
+// On-disk layout of the binary columnar packet cache written beside a .data trace.
+// A fixed header is followed by one 64-byte aligned column per field, in the same
+// representation as the columns of packet_store, plus the labels. The header records
+// the trace and the label file the cache was built from.
+struct packet_cache_header final {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t num_pkt;
+    uint64_t num_pkt6;
+    packet_cache_stamp source;
+    packet_cache_stamp label;
+};
+
+static constexpr char packet_cache_magic[8] = {'W', 'H', 'S', 'P', 'P', 'K', 'T', 'C'};
+static constexpr uint32_t packet_cache_version = 2;
+
+struct packet_cache_layout final {
+    size_t off_ts;
+    size_t off_tp;
+    size_t off_len;
+    size_t off_ver;
+    size_t off_src_port;
+    size_t off_dst_port;
+    size_t off_src_addr;
+    size_t off_dst_addr;
+    size_t off_src_addr6;
+    size_t off_dst_addr6;
+    size_t off_label;
+    size_t file_size;
+
+    explicit packet_cache_layout(const size_t num_pkt, const size_t num_pkt6) {
+        size_t cur = sizeof(packet_cache_header);
+        const auto __column = [&cur] (const size_t bytes) -> size_t {
+            const size_t off = (cur + 63) & ~((size_t) 63);
+            cur = off + bytes;
+            return off;
+        };
+        off_ts          = __column(num_pkt * sizeof(double_t));
+        off_tp          = __column(num_pkt * sizeof(pkt_code_t));
+        off_len         = __column(num_pkt * sizeof(pkt_len_t));
+        off_ver         = __column(num_pkt * sizeof(uint8_t));
+        off_src_port    = __column(num_pkt * sizeof(pkt_port_t));
+        off_dst_port    = __column(num_pkt * sizeof(pkt_port_t));
+        off_src_addr    = __column(num_pkt * sizeof(pkt_addr4_t));
+        off_dst_addr    = __column(num_pkt * sizeof(pkt_addr4_t));
+        off_src_addr6   = __column(num_pkt6 * sizeof(pkt_addr6_t));
+        off_dst_addr6   = __column(num_pkt6 * sizeof(pkt_addr6_t));
+        off_label       = __column(num_pkt * sizeof(uint8_t));
+        file_size       = cur;
+    }
+};
+
+}
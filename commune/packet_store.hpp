@@ -0,0 +1,199 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "packet_info.hpp"
+#include "field_parser.hpp"
+
+namespace Whisper
+{
+
+enum pkt_ip_ver_t : uint8_t {
+    PKT_IP_BAD  = 0,
+    PKT_IP4     = 4,
+    PKT_IP6     = 6,
+};
+
+// Worker-local IPv6 (src, dst) address pairs, merged into a packet_store after parsing
+using addr6_buf_t = vector<pair<pkt_addr6_t, pkt_addr6_t> >;
+
+// Contiguous struct-of-arrays packet table, filled by the parser and consumed by index.
+// The address columns hold the IPv4 address, or for IPv6 packets the index into the
+// 128-bit address columns, so a packet costs 25 bytes plus the rare IPv6 addresses.
+struct packet_store final {
+
+    vector<double_t> ts;
+    vector<pkt_code_t> tp;
+    vector<pkt_len_t> len;
+    vector<uint8_t> ip_ver;
+    vector<pkt_port_t> src_port;
+    vector<pkt_port_t> dst_port;
+    vector<pkt_addr4_t> src_addr;
+    vector<pkt_addr4_t> dst_addr;
+
+    vector<pkt_addr6_t> src_addr6;
+    vector<pkt_addr6_t> dst_addr6;
+
+    packet_store() = default;
+    explicit packet_store(const size_t num_pkt) {
+        resize(num_pkt);
+    }
+    virtual ~packet_store() {}
+    packet_store & operator=(const packet_store &) = delete;
+    packet_store(const packet_store &) = delete;
+
+    void resize(const size_t num_pkt) {
+        ts.resize(num_pkt);
+        tp.resize(num_pkt);
+        len.resize(num_pkt);
+        ip_ver.resize(num_pkt);
+        src_port.resize(num_pkt);
+        dst_port.resize(num_pkt);
+        src_addr.resize(num_pkt);
+        dst_addr.resize(num_pkt);
+    }
+
+    inline auto size() const -> size_t {
+        return ts.size();
+    }
+
+    inline auto is_ipv4(const size_t i) const -> bool {
+        return ip_ver[i] == PKT_IP4;
+    }
+
+    inline auto is_ipv6(const size_t i) const -> bool {
+        return ip_ver[i] == PKT_IP6;
+    }
+
+    inline auto get_flow_id4(const size_t i) const -> tuple4_conn4 {
+        assert(is_ipv4(i));
+        return {src_addr[i], dst_addr[i], src_port[i], dst_port[i]};
+    }
+
+    inline auto get_flow_id6(const size_t i) const -> tuple4_conn6 {
+        assert(is_ipv6(i));
+        return {src_addr6[src_addr[i]], dst_addr6[dst_addr[i]], src_port[i], dst_port[i]};
+    }
+
+    inline void set_packet4(const size_t i, const tuple4_conn4 & flow_id,
+                            const double_t _ts, const pkt_code_t _tp, const pkt_len_t _len) {
+        ts[i] = _ts;
+        tp[i] = _tp;
+        len[i] = _len;
+        ip_ver[i] = PKT_IP4;
+        src_addr[i] = tuple_get_src_addr(flow_id);
+        dst_addr[i] = tuple_get_dst_addr(flow_id);
+        src_port[i] = tuple_get_src_port(flow_id);
+        dst_port[i] = tuple_get_dst_port(flow_id);
+    }
+
+    // addr6_index refers to the IPv6 address columns, or to a worker-local buffer
+    // that is rebased later, see rebase_addr6().
+    inline void set_packet6(const size_t i, const pkt_addr4_t addr6_index,
+                            const pkt_port_t s_port, const pkt_port_t d_port,
+                            const double_t _ts, const pkt_code_t _tp, const pkt_len_t _len) {
+        ts[i] = _ts;
+        tp[i] = _tp;
+        len[i] = _len;
+        ip_ver[i] = PKT_IP6;
+        src_addr[i] = dst_addr[i] = addr6_index;
+        src_port[i] = s_port;
+        dst_port[i] = d_port;
+    }
+
+    inline void set_packet_bad(const size_t i) {
+        ts[i] = 0;
+        tp[i] = 0;
+        len[i] = 0;
+        ip_ver[i] = PKT_IP_BAD;
+        src_addr[i] = dst_addr[i] = 0;
+        src_port[i] = dst_port[i] = 0;
+    }
+
+    // Shift the IPv6 address indices of [_from, _to) by offset
+    void rebase_addr6(const size_t _from, const size_t _to, const pkt_addr4_t offset) {
+        if (offset == 0) {
+            return;
+        }
+        for (size_t i = _from; i < _to; ++ i) {
+            if (ip_ver[i] == PKT_IP6) {
+                src_addr[i] += offset;
+                dst_addr[i] += offset;
+            }
+        }
+    }
+
+    // Append the worker-local IPv6 buffers to the address columns, _assign[k] being the
+    // slot range that was parsed into _addr6[k]
+    void merge_addr6(const vector<pair<size_t, size_t> > & _assign, const vector<addr6_buf_t> & _addr6) {
+        size_t num_pkt6 = src_addr6.size();
+        for (const auto & _buf : _addr6) {
+            num_pkt6 += _buf.size();
+        }
+        src_addr6.reserve(num_pkt6);
+        dst_addr6.reserve(num_pkt6);
+
+        for (size_t core = 0; core < _assign.size(); ++ core) {
+            if (_addr6[core].empty()) {
+                continue;
+            }
+            rebase_addr6(_assign[core].first, _assign[core].second, src_addr6.size());
+            for (const auto & _a : _addr6[core]) {
+                src_addr6.push_back(_a.first);
+                dst_addr6.push_back(_a.second);
+            }
+        }
+    }
+
+    // Decode one "4 sIP dIP sPort dPort ts tp len" (or "6 ...") text record into slot i,
+    // the only decoder of the text format.
+    // IPv6 address pairs are appended to the worker-local addr6_buf and slot i keeps
+    // their local index, see rebase_addr6().
+    void parse_record(const size_t i, const char * str, const char * const str_end,
+                      addr6_buf_t & addr6_buf) {
+        field_parser fp(str, str_end);
+        int t = 0;
+        fp.next_int(t);
+        if (t == 4) {
+            pkt_addr4_t sIP = 0, dIP = 0;
+            fp.next_uint(sIP);
+            fp.next_uint(dIP);
+            pkt_port_t sp = 0, dp = 0;
+            fp.next_uint(sp);
+            fp.next_uint(dp);
+            double_t _str_time = 0;
+            fp.next_double(_str_time);
+            pkt_code_t _tp = 0;
+            pkt_len_t _len = 0;
+            fp.next_uint(_tp);
+            fp.next_uint(_len);
+            set_packet4(i, {sIP, dIP, sp, dp}, _str_time / 1e6, _tp, _len);
+        } else if (t == 6) {
+            pkt_addr6_t sIP = 0, dIP = 0;
+            fp.next_uint128(sIP);
+            fp.next_uint128(dIP);
+            pkt_port_t sp = 0, dp = 0;
+            fp.next_uint(sp);
+            fp.next_uint(dp);
+            double_t _str_time = 0;
+            fp.next_double(_str_time);
+            pkt_code_t _tp = 0;
+            pkt_len_t _len = 0;
+            fp.next_uint(_tp);
+            fp.next_uint(_len);
+            set_packet6(i, addr6_buf.size(), sp, dp, _str_time / 1e6, _tp, _len);
+            addr6_buf.push_back({sIP, dIP});
+        } else {
+            set_packet_bad(i);
+        }
+    }
+
+    // Approximate heap footprint of the table
+    auto memory_usage() const -> size_t {
+        return size() * (sizeof(double_t) + sizeof(pkt_code_t) + sizeof(pkt_len_t) + sizeof(uint8_t)
+                         + 2 * sizeof(pkt_port_t) + 2 * sizeof(pkt_addr4_t))
+            + src_addr6.size() * 2 * sizeof(pkt_addr6_t);
+    }
+};
+
+}
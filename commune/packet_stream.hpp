@@ -0,0 +1,149 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "packet_store.hpp"
+
+#include <atomic>
+#include <chrono>
+
+namespace Whisper
+{
+
+// Fixed-size slice of a streamed trace, with the labels of the same packets.
+// base_index is the global index of the first packet in the trace.
+struct packet_batch final {
+    size_t base_index = 0;
+    shared_ptr<packet_store> p_pkts;
+    shared_ptr<vector<uint8_t> > p_labels;
+
+    packet_batch(): p_pkts(make_shared<packet_store>()), p_labels(make_shared<vector<uint8_t> >()) {}
+    virtual ~packet_batch() {}
+    packet_batch & operator=(const packet_batch &) = delete;
+    packet_batch(const packet_batch &) = delete;
+
+    inline auto size() const -> size_t {
+        return p_pkts->size();
+    }
+
+    // Keep the column capacity for the next round
+    void reset() {
+        base_index = 0;
+        p_pkts->src_addr6.clear();
+        p_pkts->dst_addr6.clear();
+        p_labels->clear();
+    }
+};
+
+
+// Lock-free single-producer single-consumer ring of fixed capacity. head is only
+// written by the consumer and tail by the producer, each on its own cache line.
+template<typename T>
+class spsc_ring final {
+
+private:
+
+    const size_t capacity;
+    vector<T> slots;
+
+    alignas(64) atomic<size_t> head{0};
+    alignas(64) atomic<size_t> tail{0};
+
+public:
+
+    explicit spsc_ring(const size_t _capacity): capacity(max<size_t>(1, _capacity)), slots(capacity) {}
+    spsc_ring & operator=(const spsc_ring &) = delete;
+    spsc_ring(const spsc_ring &) = delete;
+
+    // item is left untouched when the ring is full
+    auto try_push(T & item) -> bool {
+        const size_t _tail = tail.load(memory_order_relaxed);
+        if (_tail - head.load(memory_order_acquire) >= capacity) {
+            return false;
+        }
+        slots[_tail % capacity] = move(item);
+        tail.store(_tail + 1, memory_order_release);
+        return true;
+    }
+
+    auto try_pop(T & item) -> bool {
+        const size_t _head = head.load(memory_order_relaxed);
+        if (_head == tail.load(memory_order_acquire)) {
+            return false;
+        }
+        item = move(slots[_head % capacity]);
+        head.store(_head + 1, memory_order_release);
+        return true;
+    }
+};
+
+
+// Parser -> analyzer hand-off of the streaming pipeline. Batches travel through the
+// filled ring and come back through the recycled ring, so at most depth + 2 batches
+// are ever allocated and their columns keep their capacity from one round to the next.
+class packet_batch_pipe final {
+
+private:
+
+    spsc_ring<shared_ptr<packet_batch> > filled;
+    spsc_ring<shared_ptr<packet_batch> > recycled;
+    atomic<bool> closed{false};
+
+    static inline void backoff(size_t & spin) {
+        if (++ spin < 64) {
+            this_thread::yield();
+        } else {
+            this_thread::sleep_for(chrono::microseconds(50));
+        }
+    }
+
+public:
+
+    explicit packet_batch_pipe(const size_t depth): filled(depth), recycled(max<size_t>(1, depth) + 2) {}
+    packet_batch_pipe & operator=(const packet_batch_pipe &) = delete;
+    packet_batch_pipe(const packet_batch_pipe &) = delete;
+
+    // Producer: an empty batch, recycled when one is available
+    auto acquire() -> shared_ptr<packet_batch> {
+        shared_ptr<packet_batch> p_batch;
+        if (recycled.try_pop(p_batch)) {
+            p_batch->reset();
+            return p_batch;
+        }
+        return make_shared<packet_batch>();
+    }
+
+    // Producer: waits while the ring is full, fails once the pipe is closed
+    auto push(shared_ptr<packet_batch> p_batch) -> bool {
+        for (size_t spin = 0; !filled.try_push(p_batch); backoff(spin)) {
+            if (closed.load(memory_order_acquire)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Consumer: waits for the next batch, fails once the pipe is closed and drained
+    auto pop(shared_ptr<packet_batch> & p_batch) -> bool {
+        for (size_t spin = 0; ; backoff(spin)) {
+            if (filled.try_pop(p_batch)) {
+                return true;
+            }
+            if (closed.load(memory_order_acquire)) {
+                return filled.try_pop(p_batch);
+            }
+        }
+    }
+
+    // Consumer: hand a processed batch back to the producer
+    void release(shared_ptr<packet_batch> p_batch) {
+        recycled.try_push(p_batch);
+    }
+
+    // Either side, when it stops
+    void close() {
+        closed.store(true, memory_order_release);
+    }
+};
+
+}
@@ -3,72 +3,73 @@
 
 using namespace Whisper;
 
-// bool ParserWorkerThread::parser_from_pcap() 
-// {
-// 	parser_start_time = get_time_spec();
-
-// 	pcpp::PcapFileReaderDevice *reader = new pcpp::PcapFileReaderDevice(parser_config_ptr->pcap_dir);
-//     if (!reader->open())
-//     {
-//         cout << "Error opening pcap file!" << endl;
-//         return false;
-//     }
-	
-// 	LOGF("ParserWorkerThread: Start parsing packets...");
-
-//     pcpp::RawPacket packet;
-// 	const auto _f_get_meta_pkt_info = [&packet, this]() -> shared_ptr<basic_packet> {
-// 		pcpp::Packet parsedPacket(&packet, false, pcpp::IP, pcpp::OsiModelNetworkLayer);
-
-// 		// ignore the packets out of the scope of TCP/IPv4 protocol stack
-// 		if (parsedPacket.isPacketOfType(pcpp::IPv4)) {
-// 			pcpp::IPv4Layer * IPlay = parsedPacket.getLayerOfType<pcpp::IPv4Layer>();
-
-// 			uint32_t addr = IPlay->getSrcIPv4Address().toInt();
-// 			uint16_t length = ntohs(IPlay->getIPv4Header()->totalLength);
-// 			double_t ts = GET_DOUBLE_TS(packet.getPacketTimeStamp());
-
-// 			uint16_t type_code = type_identify_mp::TYPE_UNKNOWN;
-// 			IPlay->parseNextLayer();
-// 			pcpp::ProtocolType type_next = IPlay->getNextLayer()->getProtocol();
-// 			if (type_next == pcpp::TCP) {
-// 				pcpp::TcpLayer* tcp_layer = parsedPacket.getLayerOfType<pcpp::TcpLayer>();
-// 				if (tcp_layer->getTcpHeader()->synFlag) {
-// 					type_code = type_identify_mp::TYPE_TCP_SYN;
-// 				} else if (tcp_layer->getTcpHeader()->finFlag) {
-// 					type_code = type_identify_mp::TYPE_TCP_FIN;
-// 				} else if (tcp_layer->getTcpHeader()->rstFlag) {
-// 					type_code = type_identify_mp::TYPE_TCP_RST;
-// 				} else {
-// 					type_code = type_identify_mp::TYPE_TCP;
-// 				}
-// 			} else if (type_next == pcpp::UDP) {
-// 				type_code = type_identify_mp::TYPE_UDP;
-// 			} else {
-// 				type_code = type_identify_mp::TYPE_UNKNOWN;
-// 			}
-			
-// 			return make_shared<basic_packet>(addr, type_code, length, ts);
-			
-// 		} else {
-// 			return nullptr;
-// 		}
-// 	};
-
-// 	while (reader->getNextPacket(packet)) {
-
-// 		const auto p_meta = _f_get_meta_pkt_info();
-// 		if (p_meta == nullptr) {
-// 			continue;
-// 		}
-
-// 		pkt_meta_ptr->push_back(p_meta);
-// 		++packet_count;
-// 	}
-
-// 	return true;
-
-// }
+bool ParserWorkerThread::parser_from_pcap() 
+{
+	__START_FTIMMER__
+
+	const int _fd = open(parser_config_ptr->pcap_dir.c_str(), O_RDONLY);
+	if (_fd < 0) {
+		WARNF("ParserWorkerThread: open pcap %s failed.", parser_config_ptr->pcap_dir.c_str());
+		return false;
+	}
+	struct stat _st;
+	if (fstat(_fd, &_st) != 0 || _st.st_size == 0) {
+		WARNF("ParserWorkerThread: pcap %s is empty.", parser_config_ptr->pcap_dir.c_str());
+		close(_fd);
+		return false;
+	}
+	const size_t file_size = _st.st_size;
+	void * const _map = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+	close(_fd);
+	if (_map == MAP_FAILED) {
+		WARNF("ParserWorkerThread: mmap pcap %s failed.", parser_config_ptr->pcap_dir.c_str());
+		return false;
+	}
+	madvise(_map, file_size, MADV_SEQUENTIAL);
+	const uint8_t * const p_base = static_cast<const uint8_t *>(_map);
+
+	LOGF("ParserWorkerThread: Start parsing packets...");
+
+	// Record headers must be walked in order, the frames are then decoded independently
+	vector<pcap_decoder::frame_ref> frames;
+	if (!pcap_decoder::build_index(p_base, file_size, frames)) {
+		munmap(_map, file_size);
+		return false;
+	}
+
+	const size_t num_pkt = frames.size();
+	LOGF("[Debug] num_pkt: %ld, file_size: %ld", num_pkt, file_size);
+
+	pkt_meta_ptr = make_shared<decltype(pkt_meta_ptr)::element_type>(num_pkt);
+
+	const auto p_pool = get_worker_pool();
+	const size_t multiplex_num = p_pool->size() * 4;
+	const size_t part_size = ceil(((double) num_pkt) / ((double) multiplex_num));
+	vector<pair<size_t, size_t> > _assign;
+	for (size_t core = 0, idx = 0; core < multiplex_num; ++ core, idx = min(idx + part_size, num_pkt)) {
+		_assign.push_back({idx, min(idx + part_size, num_pkt)});
+	}
+	vector<addr6_buf_t> _addr6(multiplex_num);
+	auto __f = [&] (size_t _from, size_t _to, addr6_buf_t & _buf) -> void {
+		for (size_t i = _from; i < _to; ++ i) {
+			pcap_decoder::decode_frame(p_base, frames[i], *pkt_meta_ptr, i, _buf);
+		}
+	};
+
+	p_pool->parallel_for_each(0, multiplex_num, [&] (size_t core) -> void {
+		__f(_assign[core].first, _assign[core].second, _addr6[core]);
+	}, multiplex_num);
+
+	munmap(_map, file_size);
+
+	pkt_meta_ptr->merge_addr6(_assign, _addr6);
+
+	parser_from_label();
+
+	__STOP_FTIMER__
+	__PRINTF_EXE_TIME__
+	return true;
+}
 
 bool ParserWorkerThread::parser_from_data() 
 {
@@ -90,37 +91,134 @@ bool ParserWorkerThread::parser_from_data()
 
 	pkt_meta_ptr = make_shared<decltype(pkt_meta_ptr)::element_type>(num_pkt);
 
-	const size_t multiplex_num = 64;
-	const u_int32_t part_size = ceil(((double) num_pkt) / ((double) multiplex_num));
+	const auto p_pool = get_worker_pool();
+	const size_t multiplex_num = p_pool->size() * 4;
+	const size_t part_size = ceil(((double) num_pkt) / ((double) multiplex_num));
 	vector<pair<size_t, size_t> > _assign;
 	for (size_t core = 0, idx = 0; core < multiplex_num; ++ core, idx = min(idx + part_size, num_pkt)) {
 		_assign.push_back({idx, min(idx + part_size, num_pkt)});
 	}
-	auto __f = [&] (size_t _from, size_t _to) -> void {
+	vector<addr6_buf_t> _addr6(multiplex_num);
+	auto __f = [&] (size_t _from, size_t _to, addr6_buf_t & _buf) -> void {
 		for (size_t i = _from; i < _to; ++ i) {
 			const string & str = string_temp[i];
-			if (str[0] == '4') {
-				const auto make_pkt = make_shared<basic_packet4>(str);
-				pkt_meta_ptr->at(i) = make_pkt;
-			} else if (str[0] == '6') {
-				const auto make_pkt = make_shared<basic_packet6>(str);
-				pkt_meta_ptr->at(i) = make_pkt;
-			} else {
-				const auto make_pkt = make_shared<basic_packet_bad>();
-				pkt_meta_ptr->at(i) = make_pkt;
+			pkt_meta_ptr->parse_record(i, str.data(), str.data() + str.size(), _buf);
+		}
+	};
+
+	p_pool->parallel_for_each(0, multiplex_num, [&] (size_t core) -> void {
+		__f(_assign[core].first, _assign[core].second, _addr6[core]);
+	}, multiplex_num);
+
+	pkt_meta_ptr->merge_addr6(_assign, _addr6);
+
+	parser_from_label();
+
+	__STOP_FTIMER__
+	__PRINTF_EXE_TIME__
+	return true;
+}
+
+bool ParserWorkerThread::parser_from_data_mmap() 
+{
+	__START_FTIMMER__
+
+	const int _fd = open(parser_config_ptr->dataset_dir.c_str(), O_RDONLY);
+	if (_fd < 0) {
+		WARNF("ParserWorkerThread: open dataset %s failed.", parser_config_ptr->dataset_dir.c_str());
+		return false;
+	}
+	struct stat _st;
+	if (fstat(_fd, &_st) != 0 || _st.st_size == 0) {
+		WARNF("ParserWorkerThread: dataset %s is empty.", parser_config_ptr->dataset_dir.c_str());
+		close(_fd);
+		return false;
+	}
+	const size_t file_size = _st.st_size;
+	void * const _map = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+	close(_fd);
+	if (_map == MAP_FAILED) {
+		WARNF("ParserWorkerThread: mmap dataset %s failed.", parser_config_ptr->dataset_dir.c_str());
+		return false;
+	}
+	madvise(_map, file_size, MADV_SEQUENTIAL);
+
+	const char * const p_begin = static_cast<const char *>(_map);
+	const char * const p_end = p_begin + file_size;
+
+	// Split the mapped file on newline boundaries, one part per worker
+	const auto p_pool = get_worker_pool();
+	const size_t multiplex_num = p_pool->size() * 4;
+	const size_t part_size = ceil(((double) file_size) / ((double) multiplex_num));
+	vector<pair<const char *, const char *> > _assign_text;
+	for (size_t core = 0, idx = 0; core < multiplex_num; ++ core) {
+		const char * _from = p_begin + idx;
+		const char * _to = p_begin + min(idx + part_size, file_size);
+		if (_to < p_end) {
+			_to = static_cast<const char *>(memchr(_to, '\n', p_end - _to));
+			_to = (_to == nullptr) ? p_end : _to + 1;
+		}
+		_to = max(_to, _from);
+		_assign_text.push_back({_from, _to});
+		idx = _to - p_begin;
+	}
+
+	// Same line semantics as getline(): an unterminated last line still counts
+	const auto __count = [] (const char * _from, const char * _to) -> size_t {
+		size_t cnt = count(_from, _to, '\n');
+		if (_from != _to && *(_to - 1) != '\n') {
+			++ cnt;
+		}
+		return cnt;
+	};
+
+	vector<size_t> _offset(multiplex_num + 1, 0);
+	p_pool->parallel_for_each(0, multiplex_num, [&] (size_t core) -> void {
+		_offset[core + 1] = __count(_assign_text[core].first, _assign_text[core].second);
+	}, multiplex_num);
+	for (size_t core = 0; core < multiplex_num; ++core) {
+		_offset[core + 1] += _offset[core];
+	}
+
+	const size_t num_pkt = _offset[multiplex_num];
+	LOGF("[Debug] num_pkt: %ld, file_size: %ld", num_pkt, file_size);
+
+	pkt_meta_ptr = make_shared<decltype(pkt_meta_ptr)::element_type>(num_pkt);
+
+	vector<addr6_buf_t> _addr6(multiplex_num);
+	auto __f = [&] (const char * _from, const char * _to, size_t i, addr6_buf_t & _buf) -> void {
+		while (_from < _to) {
+			const char * _eol = static_cast<const char *>(memchr(_from, '\n', _to - _from));
+			if (_eol == nullptr) {
+				_eol = _to;
 			}
+			pkt_meta_ptr->parse_record(i, _from, _eol, _buf);
+			_from = _eol + 1;
+			++ i;
 		}
 	};
 
-	vector<thread> vt;
+	p_pool->parallel_for_each(0, multiplex_num, [&] (size_t core) -> void {
+		__f(_assign_text[core].first, _assign_text[core].second, _offset[core], _addr6[core]);
+	}, multiplex_num);
+
+	munmap(_map, file_size);
+
+	vector<pair<size_t, size_t> > _assign;
 	for (size_t core = 0; core < multiplex_num; ++core) {
-		vt.emplace_back(__f, _assign[core].first, _assign[core].second);
+		_assign.push_back({_offset[core], _offset[core + 1]});
 	}
+	pkt_meta_ptr->merge_addr6(_assign, _addr6);
 
-	for (auto & t : vt)
-		t.join();
+	parser_from_label();
 
+	__STOP_FTIMER__
+	__PRINTF_EXE_TIME__
+	return true;
+}
 
+bool ParserWorkerThread::parser_from_label() 
+{
 	ifstream _ifl(parser_config_ptr->label_dir);
 	pkt_label_ptr = make_shared<decltype(pkt_label_ptr)::element_type>();
 	string ll;
@@ -136,20 +234,377 @@ bool ParserWorkerThread::parser_from_data()
 	);
 
 	assert(pkt_label_ptr->size() == pkt_meta_ptr->size());
+	return true;
+}
+
+bool ParserWorkerThread::parser_stream(const shared_ptr<packet_batch_pipe> p_pipe) 
+{
+	__START_FTIMMER__
+
+	const int _fd = open(parser_config_ptr->dataset_dir.c_str(), O_RDONLY);
+	if (_fd < 0) {
+		WARNF("ParserWorkerThread: open dataset %s failed.", parser_config_ptr->dataset_dir.c_str());
+		p_pipe->close();
+		return false;
+	}
+	struct stat _st;
+	if (fstat(_fd, &_st) != 0 || _st.st_size == 0) {
+		WARNF("ParserWorkerThread: dataset %s is empty.", parser_config_ptr->dataset_dir.c_str());
+		close(_fd);
+		p_pipe->close();
+		return false;
+	}
+	const size_t file_size = _st.st_size;
+	void * const _map = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+	close(_fd);
+	if (_map == MAP_FAILED) {
+		WARNF("ParserWorkerThread: mmap dataset %s failed.", parser_config_ptr->dataset_dir.c_str());
+		p_pipe->close();
+		return false;
+	}
+	madvise(_map, file_size, MADV_SEQUENTIAL);
+
+	char * const p_map = static_cast<char *>(_map);
+	const char * const p_begin = p_map;
+	const char * const p_end = p_begin + file_size;
+
+	// Labels are read alongside, one character per packet
+	ifstream _ifl(parser_config_ptr->label_dir);
+	if (!_ifl) {
+		WARNF("ParserWorkerThread: open label %s failed, all packets are labeled benign.", 
+			parser_config_ptr->label_dir.c_str());
+	}
+	streambuf * const p_label_buf = _ifl.rdbuf();
+
+	LOGF("ParserWorkerThread: Start streaming packets...");
+
+	const size_t batch_size = max<size_t>(1, parser_config_ptr->stream_batch_size);
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	const auto p_pool = get_worker_pool();
+	const size_t multiplex_num = p_pool->size() * 4;
+
+	vector<pair<const char *, const char *> > _lines;
+	_lines.reserve(batch_size);
+	vector<pair<size_t, size_t> > _assign;
+	vector<addr6_buf_t> _addr6(multiplex_num);
+	const char * _cur = p_begin;
+	size_t num_pkt = 0, num_batch = 0, num_no_label = 0, released = 0;
+	while (_cur < p_end) {
+		// Same line semantics as getline(): an unterminated last line still counts
+		_lines.clear();
+		while (_cur < p_end && _lines.size() < batch_size) {
+			const char * _eol = static_cast<const char *>(memchr(_cur, '\n', p_end - _cur));
+			if (_eol == nullptr) {
+				_eol = p_end;
+			}
+			_lines.push_back({_cur, _eol});
+			_cur = (_eol == p_end) ? p_end : _eol + 1;
+		}
+
+		const size_t n = _lines.size();
+		const auto p_batch = p_pipe->acquire();
+		p_batch->base_index = num_pkt;
+		auto & store = *p_batch->p_pkts;
+		store.resize(n);
+
+		const size_t part_size = ceil(((double) n) / ((double) multiplex_num));
+		_assign.clear();
+		for (size_t core = 0, idx = 0; core < multiplex_num; ++ core, idx = min(idx + part_size, n)) {
+			_assign.push_back({idx, min(idx + part_size, n)});
+			_addr6[core].clear();
+		}
+		p_pool->parallel_for_each(0, multiplex_num, [&] (size_t core) -> void {
+			for (size_t i = _assign[core].first; i < _assign[core].second; ++ i) {
+				store.parse_record(i, _lines[i].first, _lines[i].second, _addr6[core]);
+			}
+		}, multiplex_num);
+		store.merge_addr6(_assign, _addr6);
+
+		auto & labels = *p_batch->p_labels;
+		labels.reserve(n);
+		while (labels.size() < n) {
+			const int c = p_label_buf->sbumpc();
+			if (c == char_traits<char>::eof()) {
+				break;
+			}
+			if (!isspace(c)) {
+				labels.push_back(c == '1');
+			}
+		}
+		num_no_label += n - labels.size();
+		labels.resize(n, 0);
+
+		// The parsed text is never read again, drop its pages to keep the resident set bounded
+		const size_t _done = ((_cur - p_begin) / page_size) * page_size;
+		if (_done > released) {
+			madvise(p_map + released, _done - released, MADV_DONTNEED);
+			released = _done;
+		}
+
+		num_pkt += n;
+		++ num_batch;
+		if (!p_pipe->push(p_batch)) {
+			LOGF("ParserWorkerThread: consumer stopped, stop streaming.");
+			break;
+		}
+	}
+
+	munmap(_map, file_size);
+	p_pipe->close();
+
+	if (num_no_label > 0) {
+		WARNF("ParserWorkerThread: %ld packets without label.", num_no_label);
+	}
+	LOGF("[Debug] num_pkt: %ld, num_batch: %ld, file_size: %ld", num_pkt, num_batch, file_size);
 
 	__STOP_FTIMER__
 	__PRINTF_EXE_TIME__
 	return true;
 }
 
+auto ParserWorkerThread::count_stream_packets() const -> size_t 
+{
+	vector<char> _buf(1 << 20);
+	const auto __scan = [&_buf] (ifstream & _if, auto && __f) -> void {
+		while (_if.read(_buf.data(), _buf.size()) || _if.gcount() > 0) {
+			__f(_buf.data(), _buf.data() + _if.gcount());
+		}
+	};
+
+	// One label character per packet, far cheaper to count than the records
+	size_t cnt = 0;
+	ifstream _ifl(parser_config_ptr->label_dir, ios::binary);
+	if (_ifl) {
+		__scan(_ifl, [&cnt] (const char * _from, const char * _to) -> void {
+			cnt += count_if(_from, _to, [] (const char c) -> bool { return !isspace((unsigned char) c); });
+		});
+	}
+	if (cnt > 0) {
+		return cnt;
+	}
+
+	ifstream _ifd(parser_config_ptr->dataset_dir, ios::binary);
+	char _last = '\n';
+	__scan(_ifd, [&cnt, &_last] (const char * _from, const char * _to) -> void {
+		cnt += count(_from, _to, '\n');
+		_last = *(_to - 1);
+	});
+	if (_last != '\n') {
+		++ cnt;
+	}
+	return cnt;
+}
+
+auto ParserWorkerThread::get_source_path() const -> string 
+{
+	if (!parser_config_ptr->pcap_dir.empty()) {
+		return parser_config_ptr->pcap_dir;
+	}
+	return parser_config_ptr->dataset_dir;
+}
+
+auto ParserWorkerThread::get_cache_path() const -> string 
+{
+	if (!parser_config_ptr->cache_dir.empty()) {
+		return parser_config_ptr->cache_dir;
+	}
+	return get_source_path() + ".wcache";
+}
+
+bool ParserWorkerThread::save_cache() const 
+{
+	__START_FTIMMER__
+
+	const auto & store = *pkt_meta_ptr;
+	const size_t num_pkt = store.size();
+	const size_t num_pkt6 = store.src_addr6.size();
+	if (pkt_label_ptr->size() != num_pkt) {
+		WARNF("ParserWorkerThread: label size mismatch, cache not saved.");
+		return false;
+	}
+	const packet_cache_layout layout(num_pkt, num_pkt6);
+
+	// Write aside and rename, a crashed run never leaves a truncated cache behind
+	const string cache_path = get_cache_path();
+	const string temp_path = cache_path + ".tmp";
+	const int _fd = open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (_fd < 0) {
+		WARNF("ParserWorkerThread: create cache %s failed.", temp_path.c_str());
+		return false;
+	}
+	if (ftruncate(_fd, layout.file_size) != 0) {
+		WARNF("ParserWorkerThread: resize cache %s failed.", temp_path.c_str());
+		close(_fd);
+		unlink(temp_path.c_str());
+		return false;
+	}
+	void * const _map = mmap(nullptr, layout.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	close(_fd);
+	if (_map == MAP_FAILED) {
+		WARNF("ParserWorkerThread: mmap cache %s failed.", temp_path.c_str());
+		unlink(temp_path.c_str());
+		return false;
+	}
+
+	char * const p_base = static_cast<char *>(_map);
+	packet_cache_header * const p_header = reinterpret_cast<packet_cache_header *>(p_base);
+	memcpy(p_header->magic, packet_cache_magic, sizeof(packet_cache_magic));
+	p_header->version = packet_cache_version;
+	p_header->header_size = sizeof(packet_cache_header);
+	p_header->num_pkt = num_pkt;
+	p_header->num_pkt6 = num_pkt6;
+	p_header->source = packet_cache_stamp::of_file(get_source_path());
+	p_header->label = packet_cache_stamp::of_file(parser_config_ptr->label_dir);
+
+	const auto __column = [p_base] (const size_t off, const auto & ve) -> void {
+		if (!ve.empty()) {
+			memcpy(p_base + off, ve.data(), ve.size() * sizeof(ve[0]));
+		}
+	};
+	__column(layout.off_ts, store.ts);
+	__column(layout.off_tp, store.tp);
+	__column(layout.off_len, store.len);
+	__column(layout.off_ver, store.ip_ver);
+	__column(layout.off_src_port, store.src_port);
+	__column(layout.off_dst_port, store.dst_port);
+	__column(layout.off_src_addr, store.src_addr);
+	__column(layout.off_dst_addr, store.dst_addr);
+	__column(layout.off_src_addr6, store.src_addr6);
+	__column(layout.off_dst_addr6, store.dst_addr6);
+	__column(layout.off_label, *pkt_label_ptr);
+
+	munmap(_map, layout.file_size);
+	if (rename(temp_path.c_str(), cache_path.c_str()) != 0) {
+		WARNF("ParserWorkerThread: rename cache to %s failed.", cache_path.c_str());
+		unlink(temp_path.c_str());
+		return false;
+	}
+	LOGF("ParserWorkerThread: save %ld packets to cache %s.", num_pkt, cache_path.c_str());
+
+	__STOP_FTIMER__
+	__PRINTF_EXE_TIME__
+	return true;
+}
+
+bool ParserWorkerThread::load_cache() 
+{
+	__START_FTIMMER__
+
+	const string cache_path = get_cache_path();
+	struct stat _st_cache;
+	if (stat(cache_path.c_str(), &_st_cache) != 0) {
+		return false;
+	}
+
+	const int _fd = open(cache_path.c_str(), O_RDONLY);
+	if (_fd < 0) {
+		return false;
+	}
+	const size_t file_size = _st_cache.st_size;
+	if (file_size < sizeof(packet_cache_header)) {
+		close(_fd);
+		return false;
+	}
+	void * const _map = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+	close(_fd);
+	if (_map == MAP_FAILED) {
+		return false;
+	}
+
+	const char * const p_base = static_cast<const char *>(_map);
+	const packet_cache_header * const p_header = reinterpret_cast<const packet_cache_header *>(p_base);
+	const size_t num_pkt = p_header->num_pkt;
+	const size_t num_pkt6 = p_header->num_pkt6;
+	const packet_cache_layout layout(num_pkt, num_pkt6);
+	if (memcmp(p_header->magic, packet_cache_magic, sizeof(packet_cache_magic)) == 0 && 
+			p_header->version != packet_cache_version) {
+		LOGF("ParserWorkerThread: cache %s has an old version.", cache_path.c_str());
+		munmap(_map, file_size);
+		return false;
+	}
+	if (memcmp(p_header->magic, packet_cache_magic, sizeof(packet_cache_magic)) != 0 || 
+			p_header->header_size != sizeof(packet_cache_header) || 
+			num_pkt6 > num_pkt || layout.file_size != file_size) {
+		WARNF("ParserWorkerThread: cache %s is corrupted.", cache_path.c_str());
+		munmap(_map, file_size);
+		return false;
+	}
+	// Only for the trace and labels it was built from, a shared cache_dir may hold another
+	if (!(p_header->source == packet_cache_stamp::of_file(get_source_path())) || 
+			!(p_header->label == packet_cache_stamp::of_file(parser_config_ptr->label_dir))) {
+		LOGF("ParserWorkerThread: cache %s is stale.", cache_path.c_str());
+		munmap(_map, file_size);
+		return false;
+	}
+
+	// The store owns its columns, each one is a sequential copy out of the mapping. The pages
+	// of the columns copied so far are dropped as the copy goes, so the mapping never holds
+	// more than about one column besides the store.
+	madvise(_map, file_size, MADV_SEQUENTIAL);
+	const size_t page_mask = static_cast<size_t>(sysconf(_SC_PAGESIZE)) - 1;
+	size_t released = 0;
+	const auto __column = [_map, p_base, page_mask, &released] (const size_t off, const size_t n, auto & ve) -> void {
+		using value_t = typename remove_reference<decltype(ve)>::type::value_type;
+		const value_t * const _p = reinterpret_cast<const value_t *>(p_base + off);
+		ve.assign(_p, _p + n);
+		const size_t done = (off + n * sizeof(value_t)) & ~page_mask;
+		if (done > released) {
+			madvise(static_cast<char *>(_map) + released, done - released, MADV_DONTNEED);
+			released = done;
+		}
+	};
+	pkt_meta_ptr = make_shared<decltype(pkt_meta_ptr)::element_type>();
+	pkt_label_ptr = make_shared<decltype(pkt_label_ptr)::element_type>();
+	auto & store = *pkt_meta_ptr;
+	__column(layout.off_ts, num_pkt, store.ts);
+	__column(layout.off_tp, num_pkt, store.tp);
+	__column(layout.off_len, num_pkt, store.len);
+	__column(layout.off_ver, num_pkt, store.ip_ver);
+	__column(layout.off_src_port, num_pkt, store.src_port);
+	__column(layout.off_dst_port, num_pkt, store.dst_port);
+	__column(layout.off_src_addr, num_pkt, store.src_addr);
+	__column(layout.off_dst_addr, num_pkt, store.dst_addr);
+	__column(layout.off_src_addr6, num_pkt6, store.src_addr6);
+	__column(layout.off_dst_addr6, num_pkt6, store.dst_addr6);
+	__column(layout.off_label, num_pkt, *pkt_label_ptr);
+
+	munmap(_map, file_size);
+	LOGF("ParserWorkerThread: load %ld packets from cache %s.", num_pkt, cache_path.c_str());
+
+	__STOP_FTIMER__
+	__PRINTF_EXE_TIME__
+	return true;
+}
+
+auto ParserWorkerThread::get_worker_pool() -> shared_ptr<worker_pool> 
+{
+	if (p_worker_pool == nullptr) {
+		const size_t num_threads = parser_config_ptr ? parser_config_ptr->num_threads : 0;
+		p_worker_pool = make_shared<worker_pool>(num_threads);
+		LOGF("ParserWorkerThread: worker pool with %ld threads.", p_worker_pool->size());
+	}
+	return p_worker_pool;
+}
+
 bool ParserWorkerThread::run() 
 {
-	pkt_meta_ptr = make_shared<vector<shared_ptr<basic_packet>>>();
+	pkt_meta_ptr = make_shared<packet_store>();
 	pkt_label_ptr = std::make_shared<std::vector<uint8_t>>();
 
-	// parser_from_pcap();
-	parser_from_data();
-	return true;
+	if (parser_config_ptr->use_cache && load_cache()) {
+		return true;
+	}
+
+	bool res = false;
+	if (!parser_config_ptr->pcap_dir.empty()) {
+		res = parser_from_pcap();
+	} else {
+		res = parser_config_ptr->use_mmap ? parser_from_data_mmap() : parser_from_data();
+	}
+	if (res && parser_config_ptr->use_cache) {
+		save_cache();
+	}
+	return res;
 }
 
 
@@ -179,6 +634,39 @@ auto ParserWorkerThread::configure_via_json(const json & jin) -> bool
 			parser_config_ptr->label_dir = 
 				static_cast<decltype(parser_config_ptr->label_dir)>(jin["label_dir"]);
 		}
+		if (jin.count("use_mmap")) {
+			parser_config_ptr->use_mmap = 
+				static_cast<decltype(parser_config_ptr->use_mmap)>(jin["use_mmap"]);
+		}
+		if (jin.count("num_threads")) {
+			parser_config_ptr->num_threads = 
+				static_cast<decltype(parser_config_ptr->num_threads)>(jin["num_threads"]);
+		}
+		if (jin.count("use_cache")) {
+			parser_config_ptr->use_cache = 
+				static_cast<decltype(parser_config_ptr->use_cache)>(jin["use_cache"]);
+		}
+		if (jin.count("cache_dir")) {
+			parser_config_ptr->cache_dir = 
+				static_cast<decltype(parser_config_ptr->cache_dir)>(jin["cache_dir"]);
+		}
+		if (jin.count("stream_mode")) {
+			parser_config_ptr->stream_mode = 
+				static_cast<decltype(parser_config_ptr->stream_mode)>(jin["stream_mode"]);
+		}
+		if (jin.count("stream_batch_size")) {
+			parser_config_ptr->stream_batch_size = 
+				static_cast<decltype(parser_config_ptr->stream_batch_size)>(jin["stream_batch_size"]);
+		}
+		// stream_queue_depth is the name of the same setting before the ring
+		if (jin.count("stream_queue_depth")) {
+			parser_config_ptr->stream_ring_depth = 
+				static_cast<decltype(parser_config_ptr->stream_ring_depth)>(jin["stream_queue_depth"]);
+		}
+		if (jin.count("stream_ring_depth")) {
+			parser_config_ptr->stream_ring_depth = 
+				static_cast<decltype(parser_config_ptr->stream_ring_depth)>(jin["stream_ring_depth"]);
+		}
 	} catch (exception & e) {
 		WARN(e.what());
 		return false;
@@ -2,6 +2,11 @@
 
 #include "whisper_common.hpp"
 #include "analyzerWorker.hpp"
+#include "packet_store.hpp"
+#include "packet_cache.hpp"
+#include "pcap_decoder.hpp"
+#include "packet_stream.hpp"
+#include "worker_pool.hpp"
 
 
 using namespace std;
@@ -13,14 +18,35 @@ namespace Whisper
 
 class AnalyzerWorkerThread;
 class DeviceConfig;
+class whisper_detector;
 
 
 struct ParserConfigParam final {
 
+	// Capture to decode directly (pcap/pcapng), takes precedence over dataset_dir
 	string pcap_dir;
 	string dataset_dir;
 	string label_dir;
 
+	// Size of the shared worker pool, 0 for the hardware concurrency
+	size_t num_threads = 0;
+
+	// Parse the dataset in place from a memory-mapped file
+	bool use_mmap = true;
+
+	// Binary columnar cache of the parsed dataset, reloaded while the source and labels are unchanged
+	bool use_cache = false;
+	// Defaults to <pcap_dir or dataset_dir>.wcache
+	string cache_dir;
+
+	// Stream the dataset in fixed-size batches instead of loading it as a whole
+	bool stream_mode = false;
+	// Packets per batch, rounded up to whole analysis chunks unless flow_continuation is on
+	size_t stream_batch_size = 1 << 18;
+	// Slots of the parser -> analyzer ring, i.e. batches parsed ahead of the analyzer,
+	// JSON "stream_ring_depth" or "stream_queue_depth"
+	size_t stream_ring_depth = 4;
+
 	ParserConfigParam() = default;
     virtual ~ParserConfigParam() {}
     ParserConfigParam & operator=(const ParserConfigParam &) = delete;
@@ -31,11 +57,15 @@ class ParserWorkerThread {
 
 	friend class AnalyzerWorkerThread;
 	friend class DeviceConfig;
+	friend class whisper_detector;
 
 private:
 
 	shared_ptr<ParserConfigParam> parser_config_ptr;
 
+	// Shared with the analyzer and the learner
+	shared_ptr<worker_pool> p_worker_pool;
+
 	size_t packet_count;
 
 	// statistical variables
@@ -69,7 +99,7 @@ private:
 public:
 
 	// Collect the per-packets metadata
-	shared_ptr<vector<shared_ptr<basic_packet>>> pkt_meta_ptr;
+	shared_ptr<packet_store> pkt_meta_ptr;
 	shared_ptr<vector<uint8_t>> pkt_label_ptr;
 	
 	ParserWorkerThread() = default;
@@ -77,9 +107,32 @@ public:
 	ParserWorkerThread & operator=(const ParserWorkerThread&) = delete;
 	ParserWorkerThread(const ParserWorkerThread&) = delete;
 
-	// bool parser_from_pcap();
+	// Created on first use with Parser.num_threads workers, unless set beforehand
+	auto get_worker_pool() -> shared_ptr<worker_pool>;
+	void inline set_worker_pool(const shared_ptr<worker_pool> _p) {
+		p_worker_pool = _p;
+	}
+
+	bool parser_from_pcap();
 
     bool parser_from_data();
+
+	bool parser_from_data_mmap();
+
+	bool parser_from_label();
+
+	// Producer of the streaming pipeline, closes the pipe when the dataset is exhausted
+	bool parser_stream(const shared_ptr<packet_batch_pipe> p_pipe);
+
+	auto count_stream_packets() const -> size_t;
+
+	auto get_source_path() const -> string;
+
+	auto get_cache_path() const -> string;
+
+	bool save_cache() const;
+
+	bool load_cache();
 	
 	bool run();
 
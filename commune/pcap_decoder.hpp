@@ -0,0 +1,369 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "packet_info.hpp"
+#include "packet_store.hpp"
+
+namespace Whisper
+{
+
+// Header-only decoder for pcap/pcapng captures. It reads only the link layer,
+// IPv4/IPv6 and TCP/UDP headers Whisper needs, straight out of the raw buffer
+// (usually a memory-mapped capture), without building a pcpp::Packet per frame.
+// build_index() walks the record headers once; decode_frame() is independent per
+// frame, so the frames can be decoded in parallel.
+class pcap_decoder final {
+
+public:
+
+    // Location of one captured frame inside the capture buffer
+    struct frame_ref {
+        size_t offset;
+        uint32_t cap_len;
+        uint16_t link_type;
+        double_t ts;
+    };
+
+private:
+
+    enum link_type_t : uint16_t {
+        LINK_NULL       = 0,
+        LINK_ETHERNET   = 1,
+        LINK_RAW_BSD    = 12,
+        LINK_RAW_BSD2   = 14,
+        LINK_RAW        = 101,
+        LINK_LOOP       = 108,
+        LINK_LINUX_SLL  = 113,
+        LINK_IPV4       = 228,
+        LINK_IPV6       = 229,
+        LINK_LINUX_SLL2 = 276,
+    };
+
+    enum ether_type_t : uint16_t {
+        ETHER_IPV4      = 0x0800,
+        ETHER_IPV6      = 0x86DD,
+        ETHER_VLAN      = 0x8100,
+        ETHER_QINQ      = 0x88A8,
+        ETHER_QINQ_OLD  = 0x9100,
+    };
+
+    enum ip_proto_t : uint8_t {
+        PROTO_HOPOPT    = 0,
+        PROTO_ICMP      = 1,
+        PROTO_IGMP      = 2,
+        PROTO_TCP       = 6,
+        PROTO_UDP       = 17,
+        PROTO_ROUTING   = 43,
+        PROTO_FRAGMENT  = 44,
+        PROTO_AH        = 51,
+        PROTO_ICMPV6    = 58,
+        PROTO_DSTOPTS   = 60,
+    };
+
+    static inline auto load16(const uint8_t * p, const bool swap) -> uint16_t {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        return swap ? __builtin_bswap16(v) : v;
+    }
+
+    static inline auto load32(const uint8_t * p, const bool swap) -> uint32_t {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return swap ? __builtin_bswap32(v) : v;
+    }
+
+    static inline auto be16(const uint8_t * p) -> uint16_t {
+        return (static_cast<uint16_t>(p[0]) << 8) | p[1];
+    }
+
+    // Seconds of a tick counter, without losing the sub-second part to the double mantissa
+    static inline auto ticks_to_sec(const uint64_t ticks, const uint64_t ticks_per_sec) -> double_t {
+        return (double_t) (ticks / ticks_per_sec) + (double_t) (ticks % ticks_per_sec) / ticks_per_sec;
+    }
+
+    static auto index_pcap(const uint8_t * base, const size_t size, vector<frame_ref> & frames) -> bool {
+        const uint32_t magic = load32(base, false);
+        const bool swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+        const bool nano = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+        const double_t frac_scale = nano ? 1e-9 : 1e-6;
+        const uint16_t link_type = load32(base + 20, swap) & 0xFFFF;
+
+        size_t off = 24;
+        while (off + 16 <= size) {
+            const uint32_t ts_sec = load32(base + off, swap);
+            const uint32_t ts_frac = load32(base + off + 4, swap);
+            const uint32_t incl_len = load32(base + off + 8, swap);
+            if (off + 16 + incl_len > size) {
+                WARNF("pcap_decoder: truncated record at offset %ld.", off);
+                break;
+            }
+            frames.push_back({off + 16, incl_len, link_type, ts_sec + ts_frac * frac_scale});
+            off += 16 + incl_len;
+        }
+        return true;
+    }
+
+    static auto index_pcapng(const uint8_t * base, const size_t size, vector<frame_ref> & frames) -> bool {
+        struct interface_t {
+            uint16_t link_type;
+            uint64_t ticks_per_sec;
+            int64_t ts_offset;
+        };
+        vector<interface_t> interfaces;
+        bool swap = false;
+        double_t last_ts = 0;
+
+        size_t off = 0;
+        while (off + 12 <= size) {
+            // The byte order is only known once the section header is read
+            uint32_t block_type = load32(base + off, swap);
+            if (block_type == 0x0A0D0D0A || __builtin_bswap32(block_type) == 0x0A0D0D0A) {
+                const uint32_t bom = load32(base + off + 8, false);
+                if (bom == 0x1A2B3C4D) {
+                    swap = false;
+                } else if (bom == 0x4D3C2B1A) {
+                    swap = true;
+                } else {
+                    WARNF("pcap_decoder: bad pcapng byte-order magic at offset %ld.", off);
+                    return false;
+                }
+                block_type = 0x0A0D0D0A;
+                interfaces.clear();
+            }
+            const uint32_t block_len = load32(base + off + 4, swap);
+            if (block_len < 12 || (block_len & 3) || off + block_len > size) {
+                WARNF("pcap_decoder: truncated pcapng block at offset %ld.", off);
+                break;
+            }
+            const uint8_t * const body = base + off + 8;
+            const size_t body_len = block_len - 12;
+
+            if (block_type == 1 && body_len >= 8) {
+                // Interface Description Block
+                interface_t _if = {load16(body, swap), 1000000, 0};
+                for (size_t opt = 8; opt + 4 <= body_len; ) {
+                    const uint16_t code = load16(body + opt, swap);
+                    const uint16_t len = load16(body + opt + 2, swap);
+                    if (code == 0 || opt + 4 + len > body_len) {
+                        break;
+                    }
+                    if (code == 9 && len >= 1) {
+                        // if_tsresol: negative power of 10, or of 2 with the MSB set
+                        const uint8_t v = body[opt + 4];
+                        uint64_t ticks = 1;
+                        if (v & 0x80) {
+                            ticks = (v & 0x7F) < 64 ? (1ull << (v & 0x7F)) : 1;
+                        } else {
+                            for (uint8_t k = 0; k < v && k < 19; ++ k) ticks *= 10;
+                        }
+                        _if.ticks_per_sec = ticks;
+                    } else if (code == 14 && len >= 8) {
+                        // if_tsoffset, seconds
+                        uint64_t _o = swap ?
+                            ((uint64_t) load32(body + opt + 4, swap) << 32) | load32(body + opt + 8, swap) :
+                            ((uint64_t) load32(body + opt + 8, swap) << 32) | load32(body + opt + 4, swap);
+                        _if.ts_offset = static_cast<int64_t>(_o);
+                    }
+                    opt += 4 + ((len + 3) & ~3u);
+                }
+                interfaces.push_back(_if);
+            } else if ((block_type == 6 || block_type == 2) && body_len >= 20) {
+                // Enhanced Packet Block, or the obsolete Packet Block
+                const uint32_t if_id = block_type == 6 ? load32(body, swap) : load16(body, swap);
+                const uint64_t ticks = ((uint64_t) load32(body + 4, swap) << 32) | load32(body + 8, swap);
+                const uint32_t cap_len = load32(body + 12, swap);
+                if (if_id >= interfaces.size() || 20 + (size_t) cap_len > body_len) {
+                    WARNF("pcap_decoder: bad pcapng packet block at offset %ld.", off);
+                } else {
+                    const auto & _if = interfaces[if_id];
+                    last_ts = ticks_to_sec(ticks, _if.ticks_per_sec) + _if.ts_offset;
+                    frames.push_back({off + 28, cap_len, _if.link_type, last_ts});
+                }
+            } else if (block_type == 3 && body_len >= 4) {
+                // Simple Packet Block carries no timestamp, reuse the last one
+                const uint32_t orig_len = load32(body, swap);
+                if (!interfaces.empty()) {
+                    const uint32_t cap_len = min<size_t>(orig_len, body_len - 4);
+                    frames.push_back({off + 12, cap_len, interfaces[0].link_type, last_ts});
+                }
+            }
+            off += block_len;
+        }
+        return true;
+    }
+
+public:
+
+    // Collect the location of every captured frame, in capture order
+    static auto build_index(const uint8_t * base, const size_t size, vector<frame_ref> & frames) -> bool {
+        if (size < 24) {
+            WARNF("pcap_decoder: capture too short.");
+            return false;
+        }
+        const uint32_t magic = load32(base, false);
+        if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1) {
+            return index_pcap(base, size, frames);
+        }
+        if (magic == 0x0A0D0D0A) {
+            return index_pcapng(base, size, frames);
+        }
+        WARNF("pcap_decoder: unknown capture magic 0x%08x.", magic);
+        return false;
+    }
+
+    // Decode one frame into slot i of the store. Frames out of the scope of the
+    // IPv4/IPv6 stack become bad records, so indices stay aligned with the labels.
+    static void decode_frame(const uint8_t * base, const frame_ref & fr,
+                             packet_store & store, const size_t i, addr6_buf_t & addr6_buf) {
+        const uint8_t * p = base + fr.offset;
+        size_t n = fr.cap_len;
+
+        // Link layer, resolved to an ether type or to the IP version nibble
+        uint16_t ether_type = 0;
+        switch (fr.link_type) {
+        case LINK_ETHERNET:
+            if (n < 14) break;
+            ether_type = be16(p + 12);
+            p += 14, n -= 14;
+            while ((ether_type == ETHER_VLAN || ether_type == ETHER_QINQ || ether_type == ETHER_QINQ_OLD) && n >= 4) {
+                ether_type = be16(p + 2);
+                p += 4, n -= 4;
+            }
+            break;
+        case LINK_LINUX_SLL:
+            if (n < 16) break;
+            ether_type = be16(p + 14);
+            p += 16, n -= 16;
+            break;
+        case LINK_LINUX_SLL2:
+            if (n < 20) break;
+            ether_type = be16(p);
+            p += 20, n -= 20;
+            break;
+        case LINK_NULL:
+        case LINK_LOOP:
+            if (n < 4) break;
+            p += 4, n -= 4;
+            // fall through
+        case LINK_RAW:
+        case LINK_RAW_BSD:
+        case LINK_RAW_BSD2:
+        case LINK_IPV4:
+        case LINK_IPV6:
+            if (n < 1) break;
+            ether_type = (p[0] >> 4) == 4 ? ETHER_IPV4 : ((p[0] >> 4) == 6 ? ETHER_IPV6 : 0);
+            break;
+        default:
+            break;
+        }
+
+        pkt_code_t code = 0;
+        pkt_len_t len = 0;
+        uint8_t proto = 0;
+        const uint8_t * l4 = nullptr;
+        size_t l4_len = 0;
+
+        if (ether_type == ETHER_IPV4) {
+            if (n < 20) {
+                store.set_packet_bad(i);
+                return;
+            }
+            const size_t ihl = (p[0] & 0x0F) * 4;
+            if ((p[0] >> 4) != 4 || ihl < 20 || n < ihl) {
+                store.set_packet_bad(i);
+                return;
+            }
+            set_pkt_type_code(code, pkt_type_t::IPv4);
+            len = be16(p + 2);
+            proto = p[9];
+            if ((be16(p + 6) & 0x1FFF) == 0) {
+                l4 = p + ihl;
+                l4_len = n - ihl;
+            }
+        } else if (ether_type == ETHER_IPV6) {
+            if (n < 40 || (p[0] >> 4) != 6) {
+                store.set_packet_bad(i);
+                return;
+            }
+            set_pkt_type_code(code, pkt_type_t::IPv6);
+            len = be16(p + 4) + 40;
+            proto = p[6];
+            size_t off = 40;
+            bool first_fragment = true;
+            while (off + 8 <= n) {
+                if (proto == PROTO_HOPOPT || proto == PROTO_ROUTING || proto == PROTO_DSTOPTS) {
+                    const size_t ext_len = (p[off + 1] + 1) * 8;
+                    proto = p[off];
+                    off += ext_len;
+                } else if (proto == PROTO_AH) {
+                    const size_t ext_len = (p[off + 1] + 2) * 4;
+                    proto = p[off];
+                    off += ext_len;
+                } else if (proto == PROTO_FRAGMENT) {
+                    first_fragment = (be16(p + off + 2) >> 3) == 0;
+                    proto = p[off];
+                    off += 8;
+                } else {
+                    break;
+                }
+            }
+            if (first_fragment && off <= n) {
+                l4 = p + off;
+                l4_len = n - off;
+            }
+        } else {
+            store.set_packet_bad(i);
+            return;
+        }
+
+        // Transport layer
+        pkt_port_t s_port = 0, d_port = 0;
+        switch (proto) {
+        case PROTO_TCP:
+            if (l4 != nullptr && l4_len >= 14) {
+                s_port = be16(l4);
+                d_port = be16(l4 + 2);
+                const uint8_t flags = l4[13];
+                if (flags & 0x02) set_pkt_type_code(code, pkt_type_t::TCP_SYN);
+                if (flags & 0x10) set_pkt_type_code(code, pkt_type_t::TCP_ACK);
+                if (flags & 0x01) set_pkt_type_code(code, pkt_type_t::TCP_FIN);
+                if (flags & 0x04) set_pkt_type_code(code, pkt_type_t::TCP_RST);
+            }
+            break;
+        case PROTO_UDP:
+            set_pkt_type_code(code, pkt_type_t::UDP);
+            if (l4 != nullptr && l4_len >= 4) {
+                s_port = be16(l4);
+                d_port = be16(l4 + 2);
+            }
+            break;
+        case PROTO_ICMP:
+        case PROTO_ICMPV6:
+            set_pkt_type_code(code, pkt_type_t::ICMP);
+            break;
+        case PROTO_IGMP:
+            set_pkt_type_code(code, pkt_type_t::IGMP);
+            break;
+        default:
+            set_pkt_type_code(code, pkt_type_t::UNKNOWN);
+            break;
+        }
+
+        // Addresses keep the network byte order, as in the .data traces
+        if (ether_type == ETHER_IPV4) {
+            pkt_addr4_t s_addr, d_addr;
+            memcpy(&s_addr, p + 12, sizeof(s_addr));
+            memcpy(&d_addr, p + 16, sizeof(d_addr));
+            store.set_packet4(i, {s_addr, d_addr, s_port, d_port}, fr.ts, code, len);
+        } else {
+            pkt_addr6_t s_addr, d_addr;
+            memcpy(&s_addr, p + 8, sizeof(s_addr));
+            memcpy(&d_addr, p + 24, sizeof(d_addr));
+            store.set_packet6(i, addr6_buf.size(), s_port, d_port, fr.ts, code, len);
+            addr6_buf.push_back({s_addr, d_addr});
+        }
+    }
+};
+
+}
@@ -0,0 +1,366 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "weight_kernel.hpp"
+
+#include <mutex>
+
+namespace Whisper
+{
+
+// Row-major [frame][bin] power spectrogram, log2(1 + |X|^2) per cell
+struct spectrogram final {
+    size_t num_frame = 0;
+    size_t num_bin = 0;
+    // Rows from a single precision kernel, in data32 instead of data
+    bool single = false;
+    vector<double_t> data;
+    vector<float> data32;
+    // Row i holds the sum of frames [0, i), see build_prefix(). Double in either case.
+    vector<double_t> prefix;
+
+    inline auto row(const size_t i) const -> const double_t * {
+        return data.data() + i * num_bin;
+    }
+
+    inline auto row(const size_t i) -> double_t * {
+        return data.data() + i * num_bin;
+    }
+
+    inline auto row32(const size_t i) const -> const float * {
+        return data32.data() + i * num_bin;
+    }
+
+    void build_prefix() {
+        if (single) {
+            build_prefix(data32.data());
+        } else {
+            build_prefix(data.data());
+        }
+    }
+
+    template<typename T>
+    void build_prefix(const T * const p_rows) {
+        prefix.resize((num_frame + 1) * num_bin);
+        fill(prefix.begin(), prefix.begin() + num_bin, 0.0);
+        for (size_t i = 0; i < num_frame; ++ i) {
+            const double_t * const p_prev = prefix.data() + i * num_bin;
+            const T * const p_row = p_rows + i * num_bin;
+            double_t * const p_next = prefix.data() + (i + 1) * num_bin;
+            #pragma omp simd
+            for (size_t d = 0; d < num_bin; ++ d) {
+                p_next[d] = p_prev[d] + p_row[d];
+            }
+        }
+    }
+
+    // Mean of frames [_from, _to) into p_out, O(num_bin) whatever the window length.
+    // Taken in double from the prefix sums even for a float p_out, as the difference
+    // of two long sums cancels most of their digits.
+    template<typename T>
+    void window_mean(const size_t _from, const size_t _to, T * const p_out) const {
+        assert(_from < _to && _to <= num_frame && prefix.size() == (num_frame + 1) * num_bin);
+        const double_t * const p_lo = prefix.data() + _from * num_bin;
+        const double_t * const p_hi = prefix.data() + _to * num_bin;
+        const double_t scale = 1.0 / (_to - _from);
+        #pragma omp simd
+        for (size_t d = 0; d < num_bin; ++ d) {
+            p_out[d] = static_cast<T>((p_hi[d] - p_lo[d]) * scale);
+        }
+    }
+};
+
+
+// Short-time Fourier transform of a real signal with the semantics of the torch::stft()
+// call it replaces: periodic Hann window of n_fft, hop n_fft / 4, centered frames with
+// reflect padding, onesided n_fft / 2 + 1 bins. The window is folded into cos/sin tables
+// of every (bin, sample) pair, so any n_fft works and each frame is 2 * num_bin dot products,
+// which beats a general FFT at the small sizes the analyzer uses.
+//
+// The n_fft of the configs in use have a frame loop compiled for their size, see
+// frames_fixed(), chosen once when the kernel is built; others take frames_generic().
+//
+// A single precision kernel takes the frame products in float against float tables and
+// writes float spectrogram rows. The signal stays double, the log is taken in float.
+class stft_kernel final {
+
+private:
+
+    template<typename T>
+    using frames_fn_t = void (stft_kernel::*)(const double_t * const, const size_t, T * const) const;
+
+    template<typename T>
+    struct tables {
+        // [bin][sample], window applied
+        vector<T> cos_tab;
+        vector<T> sin_tab;
+        // [sample of the first half, n_fft / 2 included][bin], for frames_fixed()
+        vector<T> cos_half;
+        vector<T> sin_half;
+    };
+
+    const size_t n_fft;
+    const size_t hop;
+    const size_t pad;
+    const size_t num_bin;
+    const bool single;
+
+    tables<double_t> tab64;
+    tables<float> tab32;
+
+    // Only the one of the kernel precision is set
+    frames_fn_t<double_t> p_frames = nullptr;
+    frames_fn_t<float> p_frames32 = nullptr;
+
+    template<typename T>
+    inline auto get_tables() const -> const tables<T> & {
+        if constexpr (is_same<T, float>::value) {
+            return tab32;
+        } else {
+            return tab64;
+        }
+    }
+
+    // Every bin of num_frame frames hop apart, |X|^2 into rows of p_out
+    template<typename T>
+    void frames_generic(const double_t * const p, const size_t num_frame, T * const p_out) const {
+        const auto & tab = get_tables<T>();
+        // A float frame is converted once, not once per bin
+        vector<T> frame32(is_same<T, float>::value ? n_fft : 0);
+        for (size_t f = 0; f < num_frame; ++ f) {
+            const T * p_frame;
+            if constexpr (is_same<T, float>::value) {
+                copy(p + f * hop, p + f * hop + n_fft, frame32.begin());
+                p_frame = frame32.data();
+            } else {
+                p_frame = p + f * hop;
+            }
+            T * const p_row = p_out + f * num_bin;
+            for (size_t k = 0; k < num_bin; ++ k) {
+                const T * const p_cos = tab.cos_tab.data() + k * n_fft;
+                const T * const p_sin = tab.sin_tab.data() + k * n_fft;
+                T re = 0, im = 0;
+                #pragma omp simd reduction(+:re,im)
+                for (size_t n = 0; n < n_fft; ++ n) {
+                    re += p_frame[n] * p_cos[n];
+                    im += p_frame[n] * p_sin[n];
+                }
+                p_row[k] = re * re + im * im;
+            }
+        }
+    }
+
+    // frames_generic() for an even n_fft of N. The periodic Hann window and the twiddles
+    // are symmetric about N / 2, cos even and sin odd, so samples n and N - n are folded into
+    // a sum and a difference first and every bin takes N / 2 + 1 products per part instead
+    // of N. All trip counts are constants and the buffers live on the stack.
+    template<typename T, size_t N>
+    void frames_fixed(const double_t * const p, const size_t num_frame, T * const p_out) const {
+        static_assert(N % 2 == 0 && N >= 4, "stft_kernel fixed size should be even");
+        constexpr size_t H = N / 2;
+        constexpr size_t B = N / 2 + 1;
+        constexpr size_t S = N / 4;
+
+        alignas(64) T sum[H + 1];
+        alignas(64) T diff[H + 1];
+        const T * const p_cos = get_tables<T>().cos_half.data();
+        const T * const p_sin = get_tables<T>().sin_half.data();
+        for (size_t f = 0; f < num_frame; ++ f) {
+            const double_t * const x = p + f * S;
+            sum[0] = static_cast<T>(x[0]);
+            diff[0] = 0;
+            #pragma omp simd
+            for (size_t n = 1; n < H; ++ n) {
+                sum[n] = static_cast<T>(x[n] + x[N - n]);
+                diff[n] = static_cast<T>(x[n] - x[N - n]);
+            }
+            sum[H] = static_cast<T>(x[H]);
+            diff[H] = 0;
+
+            // Bins side by side, so the inner loop has no reduction
+            alignas(64) T re[B] = {};
+            alignas(64) T im[B] = {};
+            for (size_t n = 0; n <= H; ++ n) {
+                const T * const p_c = p_cos + n * B;
+                const T * const p_s = p_sin + n * B;
+                #pragma omp simd
+                for (size_t k = 0; k < B; ++ k) {
+                    re[k] += sum[n] * p_c[k];
+                    im[k] += diff[n] * p_s[k];
+                }
+            }
+            T * const p_row = p_out + f * B;
+            #pragma omp simd
+            for (size_t k = 0; k < B; ++ k) {
+                p_row[k] = re[k] * re[k] + im[k] * im[k];
+            }
+        }
+    }
+
+    // Frame loop of precision T for this n_fft
+    template<typename T>
+    auto select_frames() const -> frames_fn_t<T> {
+        switch (n_fft) {
+        case 32:
+            return &stft_kernel::frames_fixed<T, 32>;
+        case 50:
+            return &stft_kernel::frames_fixed<T, 50>;
+        case 64:
+            return &stft_kernel::frames_fixed<T, 64>;
+        case 128:
+            return &stft_kernel::frames_fixed<T, 128>;
+        default:
+            return &stft_kernel::frames_generic<T>;
+        }
+    }
+
+    // log2(1 + |X|^2) of every cell in the precision of the cells, non-finite ones to 0
+    template<typename T>
+    static void take_log(vector<T> & cells) {
+        T * const p_data = cells.data();
+        const size_t num_cell = cells.size();
+        // log2(1 + 0) = 0, the kernel below only sees finite cells
+        for (size_t i = 0; i < num_cell; ++ i) {
+            if (!isfinite(p_data[i])) {
+                p_data[i] = 0;
+            }
+        }
+        #pragma omp simd
+        for (size_t i = 0; i < num_cell; ++ i) {
+            p_data[i] = weight_kernel::log2_normal(static_cast<T>(1) + p_data[i]);
+        }
+    }
+
+public:
+
+    explicit stft_kernel(const size_t _n_fft, const bool _single = false):
+        n_fft(_n_fft), hop(max<size_t>(1, _n_fft / 4)), pad(_n_fft / 2), num_bin(_n_fft / 2 + 1),
+        single(_single) {
+        tab64.cos_tab.resize(num_bin * n_fft);
+        tab64.sin_tab.resize(num_bin * n_fft);
+        const long double two_pi = 2.0L * acosl(-1.0L);
+        for (size_t n = 0; n < n_fft; ++ n) {
+            const long double w = 0.5L - 0.5L * cosl(two_pi * n / n_fft);
+            for (size_t k = 0; k < num_bin; ++ k) {
+                // k * n reduced mod n_fft keeps the argument small and exact
+                const long double phase = two_pi * ((k * n) % n_fft) / n_fft;
+                tab64.cos_tab[k * n_fft + n] = w * cosl(phase);
+                tab64.sin_tab[k * n_fft + n] = w * sinl(phase);
+            }
+        }
+
+        if (single) {
+            p_frames32 = select_frames<float>();
+        } else {
+            p_frames = select_frames<double_t>();
+        }
+        if (is_fixed_size()) {
+            const size_t half = n_fft / 2 + 1;
+            tab64.cos_half.resize(num_bin * half);
+            tab64.sin_half.resize(num_bin * half);
+            for (size_t k = 0; k < num_bin; ++ k) {
+                for (size_t n = 0; n < half; ++ n) {
+                    tab64.cos_half[n * num_bin + k] = tab64.cos_tab[k * n_fft + n];
+                    tab64.sin_half[n * num_bin + k] = tab64.sin_tab[k * n_fft + n];
+                }
+            }
+        }
+        if (single) {
+            tab32.cos_tab.assign(tab64.cos_tab.begin(), tab64.cos_tab.end());
+            tab32.sin_tab.assign(tab64.sin_tab.begin(), tab64.sin_tab.end());
+            tab32.cos_half.assign(tab64.cos_half.begin(), tab64.cos_half.end());
+            tab32.sin_half.assign(tab64.sin_half.begin(), tab64.sin_half.end());
+        }
+    }
+
+    stft_kernel & operator=(const stft_kernel &) = delete;
+    stft_kernel(const stft_kernel &) = delete;
+
+    // Kernels are immutable, one per n_fft and precision is built on first use and shared afterwards
+    static auto get(const size_t _n_fft, const bool _single = false) -> shared_ptr<const stft_kernel> {
+        static mutex mtx;
+        static unordered_map<size_t, shared_ptr<const stft_kernel> > cache;
+        lock_guard<mutex> lock(mtx);
+        auto & p_kernel = cache[_n_fft * 2 + _single];
+        if (p_kernel == nullptr) {
+            p_kernel = make_shared<const stft_kernel>(_n_fft, _single);
+        }
+        return p_kernel;
+    }
+
+    inline auto get_n_fft() const -> size_t {
+        return n_fft;
+    }
+
+    inline auto get_num_bin() const -> size_t {
+        return num_bin;
+    }
+
+    inline auto get_hop() const -> size_t {
+        return hop;
+    }
+
+    inline auto get_pad() const -> size_t {
+        return pad;
+    }
+
+    // A frame loop compiled for this n_fft is in use
+    inline auto is_fixed_size() const -> bool {
+        return single ? p_frames32 != &stft_kernel::frames_generic<float> : 
+            p_frames != &stft_kernel::frames_generic<double_t>;
+    }
+
+    inline auto is_single() const -> bool {
+        return single;
+    }
+
+    inline auto get_num_frame(const size_t len) const -> size_t {
+        return 1 + (len + 2 * pad - n_fft) / hop;
+    }
+
+    // Reflect padding needs len > n_fft / 2, as in torch. padded is caller-owned scratch.
+    void transform(const double_t * const x, const size_t len,
+                   spectrogram & out, vector<double_t> & padded) const {
+        copy(x, x + len, input(padded, len));
+        transform_input(padded, len, out);
+    }
+
+    // Where a signal of len samples is written in padded, for transform_input()
+    inline auto input(vector<double_t> & padded, const size_t len) const -> double_t * {
+        padded.resize(len + 2 * pad);
+        return padded.data() + pad;
+    }
+
+    // transform() of the signal written at input(padded, len), without copying it
+    void transform_input(vector<double_t> & padded, const size_t len, spectrogram & out) const {
+        assert(len > pad && padded.size() == len + 2 * pad);
+
+        for (size_t j = 0; j < pad; ++ j) {
+            padded[pad - 1 - j] = padded[pad + j + 1];
+            padded[pad + len + j] = padded[pad + len - 2 - j];
+        }
+
+        transform_padded(padded.data(), padded.size(), out);
+    }
+
+    // Frames of an already padded signal, hop apart from its start, as many as fit.
+    // Returns the number of frames, the first frames * hop samples are no longer needed.
+    auto transform_padded(const double_t * const p, const size_t len, spectrogram & out) const -> size_t {
+        out.num_frame = len >= n_fft ? 1 + (len - n_fft) / hop : 0;
+        out.num_bin = num_bin;
+        out.single = single;
+        if (single) {
+            out.data32.resize(out.num_frame * num_bin);
+            (this->*p_frames32)(p, out.num_frame, out.data32.data());
+            take_log(out.data32);
+        } else {
+            out.data.resize(out.num_frame * num_bin);
+            (this->*p_frames)(p, out.num_frame, out.data.data());
+            take_log(out.data);
+        }
+        return out.num_frame;
+    }
+};
+
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+#include "packet_info.hpp"
+
+#include <array>
+#include <cstring>
+
+namespace Whisper
+{
+
+// Type code -> type / 10, every unknown code weighs as ICMP
+template<size_t num_code>
+constexpr auto weight_type_table() -> array<double_t, num_code> {
+    array<double_t, num_code> tab{};
+    for (size_t i = 0; i < num_code; ++ i) {
+        tab[i] = 10 / 10.0;
+    }
+    tab[5]   = 10 / 10.0;       // TYPE_ICMP 		= 10,
+    tab[17]  = 1 / 10.0;        // TYPE_TCP_SYN 	= 1
+    tab[33]  = 1000 / 10.0;     // TYPE_TCP_ACK 	= 1000
+    tab[49]  = 1001 / 10.0;     // TYPE_TCP_ACK + TYPE_TCP_SYN 	= 1001
+    tab[97]  = 40 / 10.0;       // TYPE_TCP_FIN 	= 40
+    tab[129] = 1 / 10.0;        // TYPE_TCP_RST 	= 1
+    tab[161] = 1 / 10.0;        // TYPE_TCP_RST + TYPE_TCP_ACK 	= 2
+    tab[257] = 3 / 10.0;        // TYPE_UDP 		= 3
+    return tab;
+}
+
+
+// 2020.12.8
+// Weight of a packet, the analyzer input signal:
+//     len * 10 + type / 10 - log2(interval) * 15.68
+// Split in two so that the packet part is taken while gathering a flow, and the interval
+// part runs over the whole contiguous array with a log2 the compiler can vectorize.
+struct weight_kernel final {
+
+    // Type codes from num_code on are unknown and weigh as ICMP
+    static constexpr size_t num_code = 512;
+
+    static constexpr array<double_t, num_code> type_weight = weight_type_table<num_code>();
+
+    static inline auto packet_part(const pkt_code_t tp, const pkt_len_t len) -> double_t {
+        return len * 10.0 + (tp < num_code ? type_weight[tp] : type_weight[0]);
+    }
+
+    // log2 of a positive normal double within 4 ulp: x = 2^e * m with m in [sqrt(1/2), sqrt(2)),
+    // log2(m) = 2 atanh(s) / ln 2 with s = (m - 1) / (m + 1), |s| < 0.172
+    static inline auto log2_normal(const double_t x) -> double_t {
+        uint64_t bits;
+        memcpy(&bits, &x, sizeof(bits));
+        // Integer operations only, a float compare or an integer-to-double conversion
+        // keeps the loop from vectorizing on plain SSE2
+        const uint64_t mant = bits & 0x000FFFFFFFFFFFFFULL;
+        // 1 when the mantissa is at least that of sqrt(2)
+        const uint64_t high = (mant + (0x0010000000000000ULL - 0x0006A09E667F3BCDULL)) >> 52;
+        const uint64_t m_bits = mant | ((0x3FFULL - high) << 52);
+        // Exponent as a double, through 2^52 + e
+        const uint64_t e_bits = ((bits >> 52) + high) | 0x4330000000000000ULL;
+        double_t m, e;
+        memcpy(&m, &m_bits, sizeof(m));
+        memcpy(&e, &e_bits, sizeof(e));
+        e -= 4503599627370496.0 + 1023;
+
+        const double_t s = (m - 1) / (m + 1);
+        const double_t s2 = s * s;
+        // Odd series of atanh, s^23 / 23 is below the last bit
+        double_t p = 1.0 / 23;
+        p = p * s2 + 1.0 / 21;
+        p = p * s2 + 1.0 / 19;
+        p = p * s2 + 1.0 / 17;
+        p = p * s2 + 1.0 / 15;
+        p = p * s2 + 1.0 / 13;
+        p = p * s2 + 1.0 / 11;
+        p = p * s2 + 1.0 / 9;
+        p = p * s2 + 1.0 / 7;
+        p = p * s2 + 1.0 / 5;
+        p = p * s2 + 1.0 / 3;
+        p = p * s2 + 1.0;
+        return e + s * p * 2.8853900817779268;     // 2 / ln 2
+    }
+
+    // The same in float for the single precision spectrogram, s^11 / 11 is below the last bit
+    static inline auto log2_normal(const float x) -> float {
+        uint32_t bits;
+        memcpy(&bits, &x, sizeof(bits));
+        const uint32_t mant = bits & 0x007FFFFFU;
+        const uint32_t high = (mant + (0x00800000U - 0x003504F3U)) >> 23;
+        const uint32_t m_bits = mant | ((0x7FU - high) << 23);
+        // Exponent as a float, through 2^23 + e
+        const uint32_t e_bits = ((bits >> 23) + high) | 0x4B000000U;
+        float m, e;
+        memcpy(&m, &m_bits, sizeof(m));
+        memcpy(&e, &e_bits, sizeof(e));
+        e -= 8388608.0f + 127;
+
+        const float s = (m - 1) / (m + 1);
+        const float s2 = s * s;
+        float p = 1.0f / 9;
+        p = p * s2 + 1.0f / 7;
+        p = p * s2 + 1.0f / 5;
+        p = p * s2 + 1.0f / 3;
+        p = p * s2 + 1.0f;
+        return e + s * p * 2.88539008f;
+    }
+
+    // out[i] += -log2(interval[i]) * 15.68, intervals are positive, see the analyzer
+    static void add_interval_part(const double_t * const interval, const size_t n, double_t * const out) {
+        #pragma omp simd
+        for (size_t i = 0; i < n; ++ i) {
+            out[i] += -log2_normal(interval[i]) * 15.68;
+        }
+    }
+};
+
+}
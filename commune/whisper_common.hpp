@@ -8,6 +8,8 @@
 #include <semaphore.h>
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <time.h>
 
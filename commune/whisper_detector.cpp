@@ -1,6 +1,12 @@
 #include "whisper_detector.hpp"
 #include "parserWorker.hpp"
 
+#include <torch/torch.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace Whisper;
 using namespace pcpp;
 
@@ -11,13 +17,46 @@ void whisper_detector::run() {
 
 	const auto parser_ptr = make_shared<ParserWorkerThread>();
 	parser_ptr->configure_via_json(j_cfg_parser);
+
+	// One pool serves every phase, the numerical libraries are capped to the same size
+	const auto p_pool = parser_ptr->get_worker_pool();
+	torch::set_num_threads(p_pool->size());
+#ifdef _OPENMP
+	omp_set_num_threads(p_pool->size());
+#endif
+
+	// Parsing overlaps the analysis only in stream mode, which is opt-in. By default the
+	// trace is parsed as a whole first. Streaming gives the same chunks and flows, see run_pipeline().
+	const auto & p_parser_config = parser_ptr->parser_config_ptr;
+	const bool sweep_mode = j_cfg_sweep.is_array() && !j_cfg_sweep.empty();
+	bool stream_mode = p_parser_config->stream_mode;
+	if (stream_mode && !p_parser_config->pcap_dir.empty()) {
+		WARNF("Streaming mode reads dataset_dir only, load pcap %s as a whole.", 
+			p_parser_config->pcap_dir.c_str());
+		stream_mode = false;
+	}
+	if (stream_mode && sweep_mode) {
+		WARNF("Sweep mode shares one loaded trace, streaming disabled.");
+		stream_mode = false;
+	}
+	if (stream_mode) {
+		run_pipeline(parser_ptr, p_pool);
+		return;
+	}
+
 	parser_ptr->run();
 
+	if (sweep_mode) {
+		run_sweep(parser_ptr, p_pool);
+		return;
+	}
+
 	const auto& k_learner_ptr = make_shared<KMeansLearner>();
 	k_learner_ptr->configure_via_json(j_cfg_kmeans);
+	k_learner_ptr->set_worker_pool(p_pool);
 	
 	const auto analyzer_ptr = make_shared<AnalyzerWorkerThread>(
-		parser_ptr->pkt_meta_ptr, parser_ptr->pkt_label_ptr, k_learner_ptr
+		parser_ptr->pkt_meta_ptr, parser_ptr->pkt_label_ptr, k_learner_ptr, p_pool
 	);
 	analyzer_ptr->configure_via_json(j_cfg_analyzer);
 
@@ -31,6 +70,111 @@ void whisper_detector::run() {
 }
 
 
+void whisper_detector::run_pipeline(const shared_ptr<ParserWorkerThread> parser_ptr, 
+								  const shared_ptr<worker_pool> p_pool) {
+
+	const auto& k_learner_ptr = make_shared<KMeansLearner>();
+	k_learner_ptr->configure_via_json(j_cfg_kmeans);
+	k_learner_ptr->set_worker_pool(p_pool);
+
+	const auto analyzer_ptr = make_shared<AnalyzerWorkerThread>(nullptr, nullptr, k_learner_ptr, p_pool);
+	analyzer_ptr->configure_via_json(j_cfg_analyzer);
+
+	// The trace is never resident, its length is taken from the label file
+	size_t sample_size = parser_ptr->count_stream_packets();
+	size_t train_sample_size = 
+		static_cast<size_t>(sample_size * analyzer_ptr->p_analyzer_config->train_ratio);
+
+	k_learner_ptr->p_learner_config->num_train_data = train_sample_size;
+
+	// Without flow_continuation a flow ends with its chunk, a batch holds whole chunks
+	auto & batch_size = parser_ptr->parser_config_ptr->stream_batch_size;
+	if (!analyzer_ptr->p_analyzer_config->flow_continuation && train_sample_size > 0) {
+		const size_t num_chunk = max<size_t>(1, (batch_size + train_sample_size - 1) / train_sample_size);
+		if (num_chunk * train_sample_size != batch_size) {
+			batch_size = num_chunk * train_sample_size;
+			LOGF("Streaming batches of %ld packets, %ld whole chunks each.", batch_size, num_chunk);
+		}
+	}
+
+	__START_FTIMMER__
+
+	const auto p_pipe = make_shared<packet_batch_pipe>(parser_ptr->parser_config_ptr->stream_ring_depth);
+	thread producer([&parser_ptr, &p_pipe] () -> void {
+		parser_ptr->parser_stream(p_pipe);
+	});
+	analyzer_ptr->run_stream(p_pipe, sample_size);
+	producer.join();
+
+	__STOP_FTIMER__
+	__PRINTF_EXE_TIME__
+}
+
+
+void whisper_detector::run_sweep(const shared_ptr<ParserWorkerThread> parser_ptr, 
+								 const shared_ptr<worker_pool> p_pool) {
+
+	const size_t num_config = j_cfg_sweep.size();
+	const size_t sample_size = parser_ptr->pkt_meta_ptr->size();
+	LOGF("Sweep %ld configurations over %ld packets.", num_config, sample_size);
+
+	vector<shared_ptr<AnalyzerWorkerThread> > analyzers;
+	for (size_t i = 0; i < num_config; ++ i) {
+		const auto & j_case = j_cfg_sweep[i];
+		json j_learner = j_cfg_kmeans;
+		json j_analyzer = j_cfg_analyzer;
+		if (j_case.count("Learner")) {
+			j_learner.merge_patch(j_case["Learner"]);
+		}
+		if (j_case.count("Analyzer")) {
+			j_analyzer.merge_patch(j_case["Analyzer"]);
+		}
+		// Each configuration writes its own result file
+		if (!j_case.count("Analyzer") || !j_case["Analyzer"].count("save_file_prefix")) {
+			const string prefix = j_analyzer.count("save_file_prefix") ? 
+				static_cast<string>(j_analyzer["save_file_prefix"]) : "";
+			j_analyzer["save_file_prefix"] = prefix + "_sweep" + to_string(i);
+		}
+		// and saves its own centers, a model saved by the same grid is loaded back per
+		// configuration, any other loaded model is shared
+		if (!j_case.count("Learner") || !j_case["Learner"].count("save_result_file")) {
+			const string base = j_learner.count("save_result_file") ? 
+				static_cast<string>(j_learner["save_result_file"]) : "";
+			j_learner["save_result_file"] = base + "_sweep" + to_string(i);
+			if (j_learner.count("load_result_file") && j_learner["load_result_file"] == base && 
+					(!j_case.count("Learner") || !j_case["Learner"].count("load_result_file"))) {
+				j_learner["load_result_file"] = j_learner["save_result_file"];
+			}
+		}
+
+		const auto k_learner_ptr = make_shared<KMeansLearner>();
+		k_learner_ptr->configure_via_json(j_learner);
+		k_learner_ptr->set_worker_pool(p_pool);
+
+		const auto analyzer_ptr = make_shared<AnalyzerWorkerThread>(
+			parser_ptr->pkt_meta_ptr, parser_ptr->pkt_label_ptr, k_learner_ptr, p_pool
+		);
+		analyzer_ptr->configure_via_json(j_analyzer);
+		// rand() is shared by the whole process, every analysis samples from its own generator
+		analyzer_ptr->set_rand_seed(i + 1);
+
+		k_learner_ptr->p_learner_config->num_train_data = 
+			static_cast<size_t>(sample_size * analyzer_ptr->p_analyzer_config->train_ratio);
+
+		analyzers.push_back(analyzer_ptr);
+	}
+
+	__START_FTIMMER__
+
+	p_pool->parallel_for_each(0, num_config, [&analyzers] (size_t i) -> void {
+		analyzers[i]->run();
+	}, num_config);
+
+	__STOP_FTIMER__
+	__PRINTF_EXE_TIME__
+}
+
+
 auto whisper_detector::configure_via_json(const json & jin) -> bool {
 	
 	if (p_configure_param) {
@@ -41,6 +185,9 @@ auto whisper_detector::configure_via_json(const json & jin) -> bool {
 	j_cfg_analyzer = jin["Analyzer"];
 	j_cfg_kmeans = jin["Learner"];
 	j_cfg_parser = jin["Parser"];
+	if (jin.count("Sweep")) {
+		j_cfg_sweep = jin["Sweep"];
+	}
 
 	return true;
 }
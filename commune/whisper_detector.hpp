@@ -38,6 +38,14 @@ private:
     json j_cfg_analyzer;
     json j_cfg_kmeans;
     json j_cfg_parser;
+    // Analyzer/Learner overrides, one analysis per entry over the same parsed trace
+    json j_cfg_sweep;
+
+    // Parser fills the next batches while the analyzer works on the current one
+    void run_pipeline(const shared_ptr<ParserWorkerThread> parser_ptr, const shared_ptr<worker_pool> p_pool);
+
+    // Analyses of every sweep entry run concurrently on the read-only packet store
+    void run_sweep(const shared_ptr<ParserWorkerThread> parser_ptr, const shared_ptr<worker_pool> p_pool);
 
 public:
     
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "../common.hpp"
+#include "whisper_common.hpp"
+
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <deque>
+#include <atomic>
+
+namespace Whisper
+{
+
+// Long-lived pool of worker threads shared by the parser, the analyzer and the learner.
+// parallel_for() lets the calling thread take part in the work and only waits for parts
+// that were actually started, so it may be called from inside a pool task as well.
+class worker_pool final {
+
+private:
+
+    vector<thread> workers;
+    deque<function<void()> > tasks;
+
+    mutable mutex task_mtx;
+    condition_variable task_cv;
+    bool stop = false;
+
+    void worker_loop() {
+        for (;;) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(task_mtx);
+                task_cv.wait(lock, [this] () -> bool { return stop || !tasks.empty(); });
+                if (stop && tasks.empty()) {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    // Book-keeping of one parallel_for(), shared with helpers that may start late
+    struct loop_state {
+        atomic<size_t> next_part{0};
+        size_t num_part = 0;
+        size_t num_done = 0;
+        mutex done_mtx;
+        condition_variable done_cv;
+        exception_ptr error;
+    };
+
+public:
+
+    // num_threads == 0 picks the hardware concurrency
+    explicit worker_pool(const size_t num_threads = 0) {
+        size_t _n = num_threads;
+        if (_n == 0) {
+            _n = max<size_t>(1, thread::hardware_concurrency());
+        }
+        for (size_t i = 0; i < _n; ++ i) {
+            workers.emplace_back(&worker_pool::worker_loop, this);
+        }
+    }
+
+    ~worker_pool() {
+        {
+            lock_guard<mutex> lock(task_mtx);
+            stop = true;
+        }
+        task_cv.notify_all();
+        for (auto & t : workers) {
+            t.join();
+        }
+    }
+
+    worker_pool & operator=(const worker_pool &) = delete;
+    worker_pool(const worker_pool &) = delete;
+
+    inline auto size() const -> size_t {
+        return workers.size();
+    }
+
+    template<typename F>
+    auto submit(F && f) -> future<decltype(f())> {
+        using ret_t = decltype(f());
+        const auto p_task = make_shared<packaged_task<ret_t()> >(forward<F>(f));
+        future<ret_t> res = p_task->get_future();
+        {
+            lock_guard<mutex> lock(task_mtx);
+            if (stop) {
+                throw logic_error("Submit to a stopped worker pool.");
+            }
+            tasks.emplace_back([p_task] () -> void { (*p_task)(); });
+        }
+        task_cv.notify_one();
+        return res;
+    }
+
+    // Run fn(_from, _to) over consecutive parts of [begin, end), at most num_part parts
+    // (default: 4 per worker). Exceptions thrown by fn are rethrown to the caller.
+    template<typename F>
+    void parallel_for(const size_t begin, const size_t end, F && fn, size_t num_part = 0) {
+        if (begin >= end) {
+            return;
+        }
+        const size_t total = end - begin;
+        if (num_part == 0) {
+            num_part = size() * 4;
+        }
+        num_part = max<size_t>(1, min(num_part, total));
+        const size_t part_size = (total + num_part - 1) / num_part;
+        num_part = (total + part_size - 1) / part_size;
+
+        const auto p_state = make_shared<loop_state>();
+        p_state->num_part = num_part;
+
+        const auto __run = [p_state, &fn, begin, end, part_size] () -> void {
+            for (;;) {
+                const size_t part = p_state->next_part.fetch_add(1);
+                if (part >= p_state->num_part) {
+                    return;
+                }
+                try {
+                    const size_t _from = begin + part * part_size;
+                    fn(_from, min(_from + part_size, end));
+                } catch (...) {
+                    lock_guard<mutex> lock(p_state->done_mtx);
+                    if (!p_state->error) {
+                        p_state->error = current_exception();
+                    }
+                }
+                lock_guard<mutex> lock(p_state->done_mtx);
+                if (++ p_state->num_done == p_state->num_part) {
+                    p_state->done_cv.notify_all();
+                }
+            }
+        };
+
+        const size_t num_helper = min(size(), num_part - 1);
+        if (num_helper > 0) {
+            {
+                lock_guard<mutex> lock(task_mtx);
+                for (size_t i = 0; i < num_helper; ++ i) {
+                    tasks.emplace_back(__run);
+                }
+            }
+            task_cv.notify_all();
+        }
+        __run();
+
+        unique_lock<mutex> lock(p_state->done_mtx);
+        p_state->done_cv.wait(lock, [&p_state] () -> bool {
+            return p_state->num_done == p_state->num_part;
+        });
+        if (p_state->error) {
+            rethrow_exception(p_state->error);
+        }
+    }
+
+    // Run fn(i) for every i in [begin, end)
+    template<typename F>
+    void parallel_for_each(const size_t begin, const size_t end, F && fn, const size_t num_part = 0) {
+        parallel_for(begin, end, [&fn] (const size_t _from, const size_t _to) -> void {
+            for (size_t i = _from; i < _to; ++ i) {
+                fn(i);
+            }
+        }, num_part);
+    }
+};
+
+}
@@ -42,7 +42,13 @@ def get_base_config(dataset_name, file_prefix):
     return {
         "Parser": {
             "dataset_dir": f"{DATASETS[dataset_name]['path']}/{file_prefix}.data",
-            "label_dir": f"{DATASETS[dataset_name]['path']}/{file_prefix}.label"
+            "label_dir": f"{DATASETS[dataset_name]['path']}/{file_prefix}.label",
+            "use_mmap": True,
+            "num_threads": 0,
+            "use_cache": False,
+            "stream_mode": False,
+            "stream_batch_size": 262144,
+            "stream_ring_depth": 4
         },
         "Learner": {
             "val_K": 10,
@@ -51,7 +57,12 @@ def get_base_config(dataset_name, file_prefix):
             "save_result_file": "",
             "load_result": False,
             "load_result_file": "",
-            "verbose": True
+            "verbose": True,
+            "algorithm": "naive",
+            "init": "random",
+            "max_iterations": 1000,
+            "batch_size": 1024,
+            "seed": 0
         },
         "Analyzer": {
             "n_fft": 32,
@@ -59,6 +70,15 @@ def get_base_config(dataset_name, file_prefix):
             "mean_win_test": 100,
             "num_train_sample": 100,
             "train_ratio": 0.5,
+            "flow_key": "src_addr",
+            "precision": "double",
+            "parallel_flow": False,
+            "flow_continuation": False,
+            "max_flows": 262144,
+            "max_flow_packets": 65536,
+            "idle_timeout": 60.0,
+            "active_timeout": 0,
+            "max_table_mb": 1024,
             "mode_verbose": True,
             "init_verbose": True,
             "center_verbose": True,
@@ -0,0 +1,102 @@
+#include "test_common.hpp"
+#include "../commune/center_scorer.hpp"
+
+#include <random>
+
+using namespace Whisper;
+
+
+static const size_t dim = 9, num_center = 6;
+static const double_t max_dist = 1e6;
+
+// Nearest center of one window by brute force, (distance, center)
+static auto brute_nearest(const arma::mat & centers, const vector<double_t> & w) -> pair<double_t, int> {
+    pair<double_t, int> best = {0, -1};
+    for (size_t j = 0; j < centers.n_cols; ++ j) {
+        double_t sq = 0;
+        for (size_t d = 0; d < dim; ++ d) {
+            sq += (w[d] - centers(d, j)) * (w[d] - centers(d, j));
+        }
+        if (best.second < 0 || sqrt(sq) < best.first) {
+            best = {sqrt(sq), (int) j};
+        }
+    }
+    return best;
+}
+
+static void check_precision(const bool single) {
+    mt19937 rng(single ? 7 : 3);
+    uniform_real_distribution<double_t> center_dist(0, 40), noise(-2, 2);
+    arma::mat centers(dim, num_center);
+    for (size_t j = 0; j < num_center; ++ j) {
+        for (size_t d = 0; d < dim; ++ d) {
+            centers(d, j) = center_dist(rng);
+        }
+    }
+
+    // Flows of one to four windows around random centers, every third one not windowed
+    window_batch batch;
+    batch.reset(dim, single);
+    vector<vector<vector<double_t> > > flows;
+    for (size_t f = 0; f < 200; ++ f) {
+        const bool windowed = f % 3 != 0;
+        batch.open_flow(windowed);
+        flows.emplace_back();
+        const size_t num_window = windowed ? 1 + rng() % 4 : 1;
+        for (size_t w = 0; w < num_window; ++ w) {
+            const size_t j = rng() % num_center;
+            vector<double_t> mean(dim);
+            for (size_t d = 0; d < dim; ++ d) {
+                mean[d] = centers(d, j) + noise(rng);
+            }
+            batch.add_window(mean.data());
+            flows.back().push_back(mean);
+        }
+    }
+    // A flow without windows keeps the no-center score
+    batch.open_flow(false);
+    flows.emplace_back();
+    CHECK(batch.num_flow() == flows.size());
+
+    center_scorer scorer;
+    scorer.reset(num_center, dim, max_dist, single);
+    CHECK(scorer.is_single() == single && scorer.get_dim() == dim);
+
+    // Centers at the origin before training ends, every window sits at its norm
+    vector<pair<double_t, int> > res;
+    scorer.score(batch, res);
+    CHECK(res.size() == flows.size() && res[0].second == 0);
+
+    scorer.set_centers(centers);
+    scorer.score(batch, res);
+    CHECK(res.size() == flows.size());
+    const double_t tol = single ? 1e-5 : 1e-12;
+    size_t num_mismatch = 0;
+    for (size_t f = 0; f + 1 < flows.size(); ++ f) {
+        pair<double_t, int> ref = {0, -1};
+        for (const auto & w : flows[f]) {
+            const auto nearest = brute_nearest(centers, w);
+            if (nearest.first > ref.first) {
+                ref = nearest;
+            }
+        }
+        num_mismatch += res[f].second != ref.second;
+        CHECK_NEAR(res[f].first, ref.first, tol);
+    }
+    CHECK(num_mismatch == 0);
+    CHECK(res.back().first == max_dist && res.back().second == -1);
+
+    // Farther than max_dist, no cluster
+    center_scorer near;
+    near.reset(num_center, dim, 1e-3, single);
+    near.set_centers(centers);
+    near.score(batch, res);
+    CHECK(res[0].first == 1e-3 && res[0].second == -1);
+}
+
+
+int main() {
+    check_precision(false);
+    check_precision(true);
+    return test_result();
+}
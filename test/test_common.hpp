@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../common.hpp"
+
+#include <unistd.h>
+
+// Checks of the unit tests. A failed check is reported and the test goes on, main()
+// returns test_result() so that ctest sees every failure of a run at once.
+static size_t __num_check = 0;
+static size_t __num_failed = 0;
+
+#define CHECK(__cond__) \
+    do {\
+        ++ __num_check;\
+        if (!(__cond__)) {\
+            ++ __num_failed;\
+            printf("[CHECK_FAILED@%s:%d->%s()]: %s\n", __FILE__, __LINE__, __FUNCTION__, #__cond__);\
+        }\
+    } while(0)
+
+// |a - b| within tol, relative to the larger magnitude once it exceeds 1
+#define CHECK_NEAR(__a__, __b__, __tol__) \
+    CHECK(std::fabs((double) (__a__) - (double) (__b__)) <= \
+        (__tol__) * std::max(1.0, std::max(std::fabs((double) (__a__)), std::fabs((double) (__b__)))))
+
+static inline auto test_result() -> int {
+    printf("%ld checks, %ld failed.\n", __num_check, __num_failed);
+    return __num_failed == 0 ? 0 : 1;
+}
+
+// Scratch file of a test, removed by the caller
+static inline auto test_temp_path(const std::string & name) -> std::string {
+    return "/tmp/whisper_test_" + std::to_string(getpid()) + "_" + name;
+}
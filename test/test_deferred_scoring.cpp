@@ -0,0 +1,133 @@
+#include "test_common.hpp"
+#include "../commune/analyzerWorker.hpp"
+
+#include <random>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+using namespace Whisper;
+
+
+// Flows tested while the learner trains are kept and scored once its centers land.
+// A run whose training is held back until the whole trace is tested must give the
+// records of a run whose training is over at once: same split, same seeded centers.
+
+static const size_t num_pkt = 60000;
+static const chrono::milliseconds hold_time(300);
+
+static auto make_trace() -> shared_ptr<packet_store> {
+    mt19937 rng(5);
+    const pkt_code_t codes[] = {5, 17, 33, 49, 97, 129, 161, 257, 1};
+    const auto p_store = make_shared<packet_store>(num_pkt);
+    double_t ts = 1600000000;
+    for (size_t i = 0; i < num_pkt; ++ i) {
+        ts += (rng() % 1000) * 1e-6;
+        const pkt_addr4_t s_addr = 0x0a000000u + (rng() % 2 ? rng() % 3 : rng() % 30);
+        p_store->set_packet4(i, {s_addr, 1, 2, 3}, ts, codes[rng() % 9], 40 + rng() % 1400);
+    }
+    return p_store;
+}
+
+// Records of the result file, sorted, as the order of the deferred parts is their own
+static auto read_results(const string & path) -> vector<string> {
+    ifstream fs(path);
+    json j;
+    fs >> j;
+    vector<string> res;
+    for (const auto & e : j["Results"]) {
+        res.push_back(e.dump());
+    }
+    sort(res.begin(), res.end());
+    return res;
+}
+
+static auto run_analyzer(const shared_ptr<packet_store> & p_store, const json & ja, 
+                         const string & centers_file, const string & prefix) -> vector<string> {
+    json jl;
+    jl["val_K"] = 4;
+    jl["num_train_data"] = 1000;
+    jl["save_result"] = !centers_file.empty();
+    jl["save_result_file"] = centers_file;
+    jl["load_result"] = false;
+    jl["load_result_file"] = "";
+    jl["verbose"] = false;
+    jl["algorithm"] = "mini_batch";
+    jl["batch_size"] = 256;
+    jl["seed"] = 7;
+    const auto p_learner = make_shared<KMeansLearner>();
+    CHECK(p_learner->configure_via_json(jl));
+
+    const auto p_labels = make_shared<vector<uint8_t> >(p_store->size(), 0);
+    AnalyzerWorkerThread analyzer(p_store, p_labels, p_learner);
+    json _ja = ja;
+    _ja["save_to_file"] = true;
+    _ja["save_dir"] = test_temp_path("results/");
+    _ja["save_file_prefix"] = prefix;
+    CHECK(analyzer.configure_via_json(_ja));
+    analyzer.set_rand_seed(1);
+    CHECK(analyzer.run());
+
+    const string result_file = test_temp_path("results/") + prefix + ".json";
+    const auto res = read_results(result_file);
+    unlink(result_file.c_str());
+    return res;
+}
+
+// The learner saves its centers to a FIFO before it publishes them, so it is held
+// in the open until the other end is opened, hold_time after the run started
+static void check_held(const shared_ptr<packet_store> & p_store, const json & ja, const string & tag) {
+    const auto ref = run_analyzer(p_store, ja, "", tag + "_ref");
+
+    const string fifo = test_temp_path("centers.fifo");
+    unlink(fifo.c_str());
+    CHECK(mkfifo(fifo.c_str(), 0600) == 0);
+    string centers;
+    atomic<bool> released{false};
+    thread holder([&] () -> void {
+        this_thread::sleep_for(hold_time);
+        ifstream fs(fifo);
+        centers.assign(istreambuf_iterator<char>(fs), istreambuf_iterator<char>());
+        released = true;
+    });
+    const auto start = chrono::steady_clock::now();
+    const auto held = run_analyzer(p_store, ja, fifo, tag + "_held");
+    const auto elapsed = chrono::steady_clock::now() - start;
+    // Should the learner never have trained, the holder gets an empty file
+    while (!released) {
+        const int fd = open(fifo.c_str(), O_WRONLY | O_NONBLOCK);
+        if (fd >= 0) {
+            close(fd);
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    holder.join();
+    unlink(fifo.c_str());
+
+    // The run waited for the centers only at its end, they were the seeded ones
+    CHECK(elapsed >= hold_time && !centers.empty());
+    CHECK(!ref.empty() && held.size() == ref.size());
+    CHECK(held == ref);
+}
+
+
+int main() {
+    const auto p_store = make_trace();
+
+    json ja;
+    ja["n_fft"] = 16;
+    ja["mean_win_train"] = 5;
+    ja["mean_win_test"] = 7;
+    ja["num_train_sample"] = 40;
+    ja["train_ratio"] = 0.5;
+    check_held(p_store, ja, "classic");
+
+    // Kept states evicted, expired and split while the learner trains
+    ja["flow_continuation"] = true;
+    ja["max_flows"] = 8;
+    ja["max_flow_packets"] = 300;
+    ja["idle_timeout"] = 0.02;
+    check_held(p_store, ja, "continuation");
+
+    rmdir(test_temp_path("results").c_str());
+    return test_result();
+}
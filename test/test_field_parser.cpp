@@ -0,0 +1,95 @@
+#include "test_common.hpp"
+#include "../commune/field_parser.hpp"
+
+#include <random>
+
+using namespace Whisper;
+
+
+// Every value is the one strtod() gives, exact fast path or not
+static void check_doubles() {
+    const vector<string> cases = {
+        "0", "1", "-1", "+2.5", "1600000000123456", "1600000000.123456", "0.000001",
+        "000000123.4500", "1e22", "1e23", "-4.9e-324", "1.7976931348623157e308",
+        "123456789012345678901234", "0.1", "3.14159265358979323846", "2.", ".5",
+    };
+    for (const auto & str : cases) {
+        field_parser fp(str);
+        double_t val = -7;
+        CHECK(fp.next_double(val));
+        CHECK(val == strtod(str.c_str(), nullptr));
+        CHECK(fp.done());
+    }
+
+    mt19937_64 rng(1);
+    char buf[64];
+    for (size_t i = 0; i < 20000; ++ i) {
+        const uint64_t mantissa = rng() >> (rng() % 64);
+        const int scale = static_cast<int>(rng() % 30);
+        snprintf(buf, sizeof(buf), "%llu.%0*llu", (unsigned long long) (mantissa / 1000000), 
+                 6, (unsigned long long) (mantissa % 1000000));
+        string str = buf;
+        if (scale > 20) {
+            str += "e-" + to_string(scale - 20);
+        }
+        field_parser fp(str);
+        double_t val = 0;
+        CHECK(fp.next_double(val) && val == strtod(str.c_str(), nullptr));
+    }
+
+    double_t val = 5;
+    const string str_none = "  x", str_dot = ".";
+    field_parser fp_none(str_none);
+    CHECK(!fp_none.next_double(val));
+    field_parser fp_dot(str_dot);
+    CHECK(!fp_dot.next_double(val));
+}
+
+
+static void check_integers() {
+    const string str = " 4\t65535  -17 +8 340282366920938463463374607431768211455 7";
+    field_parser fp(str);
+    int t = 0;
+    CHECK(fp.next_int(t) && t == 4);
+    uint16_t port = 0;
+    CHECK(fp.next_uint(port) && port == 65535);
+    int neg = 0;
+    CHECK(fp.next_int(neg) && neg == -17);
+    int pos = 0;
+    CHECK(fp.next_int(pos) && pos == 8);
+    pkt_addr6_t addr6 = 0;
+    CHECK(fp.next_uint128(addr6) && addr6 == ~static_cast<pkt_addr6_t>(0));
+    uint32_t last = 0;
+    CHECK(fp.next_uint(last) && last == 7);
+    CHECK(fp.done());
+    CHECK(!fp.next_uint(last));
+
+    // Out of range, the value saturates and the field fails, as with the stream extraction
+    const string str_over = "65536 4294967296 12";
+    field_parser fp_over(str_over);
+    uint16_t small = 0;
+    CHECK(!fp_over.next_uint(small) && small == 65535);
+    uint32_t word = 0;
+    CHECK(!fp_over.next_uint(word) && word == 4294967295u);
+    CHECK(fp_over.next_uint(word) && word == 12);
+
+    // Random values round trip
+    mt19937_64 rng(2);
+    for (size_t i = 0; i < 10000; ++ i) {
+        const uint64_t u = rng() >> (rng() % 64);
+        const int64_t s = static_cast<int64_t>(rng()) >> (rng() % 64);
+        const string str_rand = to_string(u) + " " + to_string(s);
+        field_parser fp_rand(str_rand);
+        uint64_t _u = 0;
+        int64_t _s = 0;
+        CHECK(fp_rand.next_uint(_u) && _u == u);
+        CHECK(fp_rand.next_int(_s) && _s == s);
+    }
+}
+
+
+int main() {
+    check_doubles();
+    check_integers();
+    return test_result();
+}
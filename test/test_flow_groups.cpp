@@ -0,0 +1,89 @@
+#include "test_common.hpp"
+#include "../commune/flow_group.hpp"
+
+#include <random>
+
+using namespace Whisper;
+
+
+// Grouping of n keys drawn by next_key against an ordered map of position lists
+template<typename F>
+static void check_grouping(flow_groups & groups, const size_t n, F && next_key) {
+    map<uint32_t, vector<size_t> > ref;
+    groups.clear();
+    for (size_t i = 0; i < n; ++ i) {
+        const uint32_t k = next_key();
+        // Positions need not start at zero nor be contiguous
+        groups.add(k, 3 * i + 1);
+        ref[k].push_back(3 * i + 1);
+    }
+    groups.group();
+
+    CHECK(groups.num_flow() == ref.size());
+    if (groups.num_flow() != ref.size()) {
+        return;
+    }
+    size_t f = 0;
+    bool same = true;
+    for (const auto & [k, positions] : ref) {
+        const auto range = groups.flow(f);
+        same = same && groups.key(f) == k && range.size() == positions.size() &&
+            equal(range.begin(), range.end(), positions.begin());
+        ++ f;
+    }
+    CHECK(same);
+}
+
+
+static void check_key_ids() {
+    key_ids<tuple4_conn4> ids;
+    for (size_t round = 0; round < 2; ++ round) {
+        ids.reset(round == 0 ? 4000 : 900);
+        vector<tuple4_conn4> seen;
+        mt19937 rng(round);
+        bool same = true;
+        for (size_t i = 0; i < 5000; ++ i) {
+            const tuple4_conn4 key = {rng() % 30, 1, (pkt_port_t) (rng() % 30), 80};
+            const auto it = find(seen.begin(), seen.end(), key);
+            const uint32_t id = ids.get_id(key);
+            if (it == seen.end()) {
+                same = same && id == seen.size();
+                seen.push_back(key);
+            } else {
+                same = same && id == it - seen.begin();
+            }
+            same = same && ids.get_key(id) == key;
+        }
+        // First-seen order, the same after a reset to a smaller table
+        CHECK(same && seen.size() > 800 && seen.size() <= 900);
+    }
+}
+
+
+int main() {
+    // One instance for every chunk, as the analyzer reuses its buffers
+    flow_groups groups;
+    mt19937 rng(1);
+    check_grouping(groups, 0, [&] () -> uint32_t {
+        return 0;
+    });
+    check_grouping(groups, 1000, [&] () -> uint32_t {
+        return 42;
+    });
+    check_grouping(groups, 20000, [&] () -> uint32_t {
+        return rng() % 100;
+    });
+    check_grouping(groups, 20000, [&] () -> uint32_t {
+        return rng();
+    });
+    // Keys that differ in a single radix digit only
+    check_grouping(groups, 20000, [&] () -> uint32_t {
+        return 0x80000000u | ((rng() % 64) << 11);
+    });
+    check_grouping(groups, 50000, [&] () -> uint32_t {
+        return rng() % 5 == 0 ? rng() : rng() % 1000;
+    });
+
+    check_key_ids();
+    return test_result();
+}
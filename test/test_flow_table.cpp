@@ -0,0 +1,165 @@
+#include "test_common.hpp"
+#include "../commune/flow_table.hpp"
+
+#include <random>
+
+using namespace Whisper;
+
+
+// A value with some heap memory, as flow_state
+struct test_value {
+    vector<uint8_t> payload;
+    int stamp = -1;
+
+    inline auto heap_bytes() const -> size_t {
+        return payload.capacity();
+    }
+};
+
+using table_t = flow_table<test_value>;
+
+static auto recount(table_t & table) -> size_t {
+    size_t bytes = table.fixed_bytes();
+    table.for_each([&] (const pkt_addr4_t &, test_value & v) -> void {
+        bytes += v.heap_bytes();
+    });
+    return bytes;
+}
+
+static const auto no_evict = [] (const pkt_addr4_t &, test_value &) -> void {};
+
+
+static void check_insert_find() {
+    table_t table(100);
+    CHECK(table.capacity() >= 100 && table.size() == 0);
+    for (pkt_addr4_t k = 0; k < 50; ++ k) {
+        test_value * const p = table.insert(k, no_evict);
+        CHECK(p != nullptr && p->stamp == -1);
+        p->stamp = k;
+    }
+    CHECK(table.size() == 50 && table.get_counters().inserted == 50);
+    for (pkt_addr4_t k = 0; k < 50; ++ k) {
+        const test_value * const p = table.find(k);
+        CHECK(p != nullptr && p->stamp == (int) k);
+    }
+    CHECK(table.find(1000) == nullptr);
+    // A second insert of a key is a lookup
+    CHECK(table.insert(7, no_evict)->stamp == 7 && table.size() == 50);
+}
+
+
+// Values handed out within a batch are never evicted, the table overflows instead
+static void check_pinning() {
+    table_t table(1);
+    const size_t capacity = table.capacity();
+    size_t num_evicted = 0;
+    const auto on_evict = [&] (const pkt_addr4_t &, test_value &) -> void {
+        ++ num_evicted;
+    };
+
+    vector<pkt_addr4_t> pinned;
+    for (pkt_addr4_t k = 0; k < 4 * capacity; ++ k) {
+        test_value * const p = table.insert(k, on_evict);
+        if (p != nullptr) {
+            p->stamp = k;
+            pinned.push_back(k);
+        }
+    }
+    CHECK(num_evicted == 0 && pinned.size() == capacity);
+    CHECK(table.get_counters().overflowed == 4 * capacity - pinned.size());
+    for (const auto k : pinned) {
+        CHECK(table.find(k) != nullptr && table.find(k)->stamp == (int) k);
+    }
+
+    // Next batch: the keys found again stay, the others make room by the clock
+    table.unpin_all();
+    const size_t num_keep = capacity / 2;
+    for (size_t i = 0; i < num_keep; ++ i) {
+        CHECK(table.find(pinned[i]) != nullptr);
+    }
+    for (pkt_addr4_t k = 1000; k < 1000 + capacity; ++ k) {
+        test_value * const p = table.insert(k, on_evict);
+        if (p != nullptr) {
+            CHECK(p->stamp == -1);
+        }
+    }
+    CHECK(num_evicted == capacity - num_keep && table.get_counters().evicted == num_evicted);
+    for (size_t i = 0; i < num_keep; ++ i) {
+        CHECK(table.find(pinned[i]) != nullptr && table.find(pinned[i])->stamp == (int) pinned[i]);
+    }
+    CHECK(table.size() == capacity);
+}
+
+
+// Heap accounting, expiry by the hand and the byte budget over many batches
+static void check_budget() {
+    table_t table(1000);
+    mt19937 rng(3);
+    size_t num_gone = 0;
+    const auto on_gone = [&] (const pkt_addr4_t &, test_value &) -> void {
+        ++ num_gone;
+    };
+    const size_t max_bytes = table.fixed_bytes() + (1 << 19);
+
+    for (int chunk = 0; chunk < 200; ++ chunk) {
+        for (size_t i = 0; i < 100; ++ i) {
+            test_value * const p = table.insert(rng() % 1200, on_gone);
+            if (p != nullptr) {
+                p->payload.resize(p->payload.size() + rng() % 500);
+                p->stamp = chunk;
+            }
+        }
+        table.unpin_all();
+        CHECK(table.memory_bytes() == recount(table));
+
+        table.expire([&] (const test_value & v) -> bool {
+            return chunk - v.stamp > 10;
+        }, on_gone, table.capacity() / 16);
+        table.trim(max_bytes, on_gone);
+        CHECK(table.memory_bytes() == recount(table) && table.memory_bytes() <= max_bytes);
+    }
+
+    const auto & stat = table.get_counters();
+    CHECK(stat.evicted > 0 && stat.expired > 0 && stat.trimmed > 0);
+    CHECK(stat.inserted == table.size() + stat.evicted + stat.expired + stat.trimmed);
+    CHECK(num_gone == stat.evicted + stat.expired + stat.trimmed);
+
+    table.clear();
+    CHECK(table.size() == 0 && table.memory_bytes() == table.fixed_bytes());
+}
+
+
+// The hand covers max_step slots per call and skips the pinned values
+static void check_expire_steps() {
+    table_t table(200);
+    for (pkt_addr4_t k = 0; k < 100; ++ k) {
+        table.insert(k, no_evict)->stamp = 0;
+    }
+    table.unpin_all();
+    CHECK(table.find(5) != nullptr);
+
+    const auto all = [] (const test_value &) -> bool {
+        return true;
+    };
+    const size_t step = table.capacity() / 4;
+    size_t last = table.size();
+    for (size_t i = 0; i < 4; ++ i) {
+        table.expire(all, no_evict, step);
+        CHECK(table.size() <= last);
+        last = table.size();
+    }
+    // One lap, only the pinned key is left
+    CHECK(table.size() == 1 && table.find(5) != nullptr);
+    table.unpin_all();
+    table.expire(all, no_evict, table.capacity());
+    CHECK(table.size() == 0 && table.get_counters().expired == 100);
+}
+
+
+int main() {
+    check_insert_find();
+    check_pinning();
+    check_budget();
+    check_expire_steps();
+    return test_result();
+}
@@ -0,0 +1,103 @@
+#include "test_common.hpp"
+#include "../commune/mini_batch_kmeans.hpp"
+
+#include <random>
+
+using namespace Whisper;
+
+
+static const size_t dim = 5, K = 4, num = 20000;
+
+// Samples around K centers far apart, column-major
+static auto make_samples(vector<double_t> & truth) -> vector<double_t> {
+    mt19937 rng(11);
+    normal_distribution<double_t> noise(0, 1);
+    truth.resize(K * dim);
+    for (size_t j = 0; j < K; ++ j) {
+        for (size_t d = 0; d < dim; ++ d) {
+            truth[j * dim + d] = 100.0 * ((j + d) % K) + 50.0 * j;
+        }
+    }
+    vector<double_t> data(num * dim);
+    for (size_t i = 0; i < num; ++ i) {
+        for (size_t d = 0; d < dim; ++ d) {
+            data[i * dim + d] = truth[(i % K) * dim + d] + noise(rng);
+        }
+    }
+    return data;
+}
+
+// Largest distance of a true center to its nearest center found
+static auto worst_miss(const arma::mat & centers, const vector<double_t> & truth) -> double_t {
+    double_t worst = 0;
+    for (size_t t = 0; t < K; ++ t) {
+        double_t best = numeric_limits<double_t>::max();
+        for (size_t j = 0; j < centers.n_cols; ++ j) {
+            double_t sq = 0;
+            for (size_t d = 0; d < dim; ++ d) {
+                sq += (centers(d, j) - truth[t * dim + d]) * (centers(d, j) - truth[t * dim + d]);
+            }
+            best = min(best, sqrt(sq));
+        }
+        worst = max(worst, best);
+    }
+    return worst;
+}
+
+static auto same_centers(const arma::mat & a, const arma::mat & b) -> bool {
+    if (a.n_rows != b.n_rows || a.n_cols != b.n_cols) {
+        return false;
+    }
+    for (size_t j = 0; j < a.n_cols; ++ j) {
+        if (!equal(a.colptr(j), a.colptr(j) + a.n_rows, b.colptr(j))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int main() {
+    vector<double_t> truth;
+    const auto data = make_samples(truth);
+    const vector<float> data32(data.begin(), data.end());
+    worker_pool pool(4);
+
+    // k-means++ finds every cluster, to well within the noise of a center
+    arma::mat c_plain, c_pool, c32;
+    mini_batch_kmeans<double_t> plain(data.data(), dim, num, nullptr, 3);
+    const size_t num_iter = plain.cluster(K, true, 512, 1000, c_plain);
+    CHECK(c_plain.n_rows == dim && c_plain.n_cols == K);
+    CHECK(num_iter >= num / 512 && num_iter <= 1000);
+    CHECK(worst_miss(c_plain, truth) < 0.2);
+
+    // The same seed gives the same centers whatever the workers
+    mini_batch_kmeans<double_t> pooled(data.data(), dim, num, &pool, 3);
+    CHECK(pooled.cluster(K, true, 512, 1000, c_pool) == num_iter);
+    CHECK(same_centers(c_plain, c_pool));
+
+    // Float samples, double centers: the same clusters up to the rounding of the samples
+    mini_batch_kmeans<float> single(data32.data(), dim, num, &pool, 3);
+    single.cluster(K, true, 512, 1000, c32);
+    CHECK(worst_miss(c32, truth) < 0.2);
+    CHECK(c32.n_rows == dim && c32.n_cols == K);
+    for (size_t j = 0; j < K && c32.n_cols == K; ++ j) {
+        for (size_t d = 0; d < dim; ++ d) {
+            CHECK_NEAR(c32(d, j), c_plain(d, j), 1e-5);
+        }
+    }
+
+    // Sample seeding and a batch larger than the set
+    arma::mat c_sample;
+    mini_batch_kmeans<double_t> sample(data.data(), dim, 100, &pool, 5);
+    CHECK(sample.cluster(K, false, 1000, 50, c_sample) >= 1);
+    CHECK(c_sample.n_cols == K);
+
+    // Another seed, other draws, still every cluster
+    arma::mat c_other;
+    mini_batch_kmeans<double_t> other(data.data(), dim, num, &pool, 4);
+    other.cluster(K, true, 512, 1000, c_other);
+    CHECK(worst_miss(c_other, truth) < 0.2);
+
+    return test_result();
+}
@@ -0,0 +1,71 @@
+#include "test_common.hpp"
+#include "../commune/parserWorker.hpp"
+
+using namespace Whisper;
+
+
+// A .data trace with IPv4, IPv6 and malformed records, and an unterminated last line
+static const char * trace_text = 
+    "4 16777343 33663168 80 443 1600000000123456 1002 60\n"
+    "4 33663168 16777343 443 80 1600000000123999 1003 1500\n"
+    "6 42540766411282592856903984951653826561 42540766411282592856903984951653826562 53 5353 1600000000124500 3 120\n"
+    "garbage\n"
+    "\n"
+    "4 16777343 33663168 80 443 1600000000125000 1 40";
+// One character per packet, as the .label files
+static const char * label_text = "010011\n";
+
+static auto parse(const string & data_path, const string & label_path, const bool use_mmap) 
+    -> shared_ptr<ParserWorkerThread> {
+    json j;
+    j["dataset_dir"] = data_path;
+    j["label_dir"] = label_path;
+    j["use_mmap"] = use_mmap;
+    j["num_threads"] = 2;
+    const auto p_parser = make_shared<ParserWorkerThread>();
+    p_parser->configure_via_json(j);
+    CHECK(p_parser->run());
+    return p_parser;
+}
+
+
+int main() {
+    const string data_path = test_temp_path("trace.data");
+    const string label_path = test_temp_path("trace.label");
+    ofstream(data_path) << trace_text;
+    ofstream(label_path) << label_text;
+
+    const auto p_stream = parse(data_path, label_path, false);
+    const auto p_mmap = parse(data_path, label_path, true);
+    const auto & a = *p_stream->pkt_meta_ptr;
+    const auto & b = *p_mmap->pkt_meta_ptr;
+
+    // The mapped file is parsed exactly as the lines read by getline()
+    CHECK(a.size() == 6);
+    CHECK(b.size() == a.size());
+    CHECK(a.ts == b.ts);
+    CHECK(a.tp == b.tp);
+    CHECK(a.len == b.len);
+    CHECK(a.ip_ver == b.ip_ver);
+    CHECK(a.src_port == b.src_port && a.dst_port == b.dst_port);
+    CHECK(a.src_addr == b.src_addr && a.dst_addr == b.dst_addr);
+    CHECK(a.src_addr6 == b.src_addr6 && a.dst_addr6 == b.dst_addr6);
+    CHECK(*p_stream->pkt_label_ptr == *p_mmap->pkt_label_ptr);
+
+    if (b.size() == 6) {
+        CHECK(b.is_ipv4(0) && b.src_addr[0] == 16777343 && b.dst_addr[0] == 33663168);
+        CHECK(b.src_port[0] == 80 && b.dst_port[0] == 443 && b.tp[0] == 1002 && b.len[0] == 60);
+        CHECK_NEAR(b.ts[0], 1600000000.123456, 1e-15);
+        CHECK(b.is_ipv6(2) && b.src_port[2] == 53 && b.dst_port[2] == 5353 && b.len[2] == 120);
+        CHECK(b.src_addr6.size() == 1);
+        CHECK(!b.is_ipv4(3) && !b.is_ipv6(3));
+        CHECK(!b.is_ipv4(4) && !b.is_ipv6(4));
+        // The last line counts without its newline
+        CHECK(b.is_ipv4(5) && b.len[5] == 40);
+        CHECK(p_mmap->pkt_label_ptr->size() == 6 && p_mmap->pkt_label_ptr->at(1) == 1);
+    }
+
+    unlink(data_path.c_str());
+    unlink(label_path.c_str());
+    return test_result();
+}
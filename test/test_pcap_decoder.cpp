@@ -0,0 +1,231 @@
+#include "test_common.hpp"
+#include "../commune/pcap_decoder.hpp"
+
+using namespace Whisper;
+
+using bytes_t = vector<uint8_t>;
+
+
+// Capture headers in host (little endian) or swapped byte order, packet headers in network order
+static void put16(bytes_t & b, const uint16_t v, const bool swap = false) {
+    const uint16_t _v = swap ? __builtin_bswap16(v) : v;
+    const auto * p = reinterpret_cast<const uint8_t *>(&_v);
+    b.insert(b.end(), p, p + sizeof(_v));
+}
+
+static void put32(bytes_t & b, const uint32_t v, const bool swap = false) {
+    const uint32_t _v = swap ? __builtin_bswap32(v) : v;
+    const auto * p = reinterpret_cast<const uint8_t *>(&_v);
+    b.insert(b.end(), p, p + sizeof(_v));
+}
+
+static void put_be16(bytes_t & b, const uint16_t v) {
+    b.push_back(v >> 8);
+    b.push_back(v & 0xFF);
+}
+
+static void put_bytes(bytes_t & b, const bytes_t & v) {
+    b.insert(b.end(), v.begin(), v.end());
+}
+
+static auto ether(const uint16_t ether_type, const bytes_t & payload, const bool vlan = false) -> bytes_t {
+    bytes_t b(12, 0xAA);
+    if (vlan) {
+        put_be16(b, 0x8100);
+        put_be16(b, 42);
+    }
+    put_be16(b, ether_type);
+    put_bytes(b, payload);
+    return b;
+}
+
+static auto ipv4(const uint8_t proto, const bytes_t & l4) -> bytes_t {
+    bytes_t b = {0x45, 0};
+    put_be16(b, 20 + l4.size());
+    put_be16(b, 0);
+    put_be16(b, 0x4000);
+    b.push_back(64);
+    b.push_back(proto);
+    put_be16(b, 0);
+    put_bytes(b, {10, 0, 0, 1, 10, 0, 0, 2});
+    put_bytes(b, l4);
+    return b;
+}
+
+static auto ipv6(const uint8_t proto, const bytes_t & l4) -> bytes_t {
+    bytes_t b = {0x60, 0, 0, 0};
+    put_be16(b, l4.size());
+    b.push_back(proto);
+    b.push_back(64);
+    for (uint8_t k = 0; k < 32; ++ k) {
+        b.push_back(k < 16 ? k : 0x80 | k);
+    }
+    put_bytes(b, l4);
+    return b;
+}
+
+static auto tcp(const uint16_t s_port, const uint16_t d_port, const uint8_t flags) -> bytes_t {
+    bytes_t b;
+    put_be16(b, s_port);
+    put_be16(b, d_port);
+    b.resize(13, 0);
+    b[12] = 0x50;
+    b.push_back(flags);
+    b.resize(20, 0);
+    return b;
+}
+
+static auto udp(const uint16_t s_port, const uint16_t d_port) -> bytes_t {
+    bytes_t b;
+    put_be16(b, s_port);
+    put_be16(b, d_port);
+    put_be16(b, 8);
+    put_be16(b, 0);
+    return b;
+}
+
+// The same frames are written in every capture format
+static auto test_frames() -> vector<bytes_t> {
+    return {
+        ether(0x0800, ipv4(6, tcp(1234, 80, 0x02))),
+        ether(0x0800, ipv4(17, udp(53, 5353)), true),
+        ether(0x86DD, ipv6(6, tcp(443, 8443, 0x10))),
+        ether(0x0806, bytes_t(28, 0)),
+        ether(0x0800, ipv4(1, bytes_t(8, 0))),
+    };
+}
+
+static const uint32_t ts_sec = 1600000000;
+
+static auto make_pcap(const bool swap, const bool nano) -> bytes_t {
+    bytes_t b;
+    put32(b, nano ? 0xa1b23c4d : 0xa1b2c3d4, swap);
+    put16(b, 2, swap);
+    put16(b, 4, swap);
+    put32(b, 0, swap);
+    put32(b, 0, swap);
+    put32(b, 65535, swap);
+    put32(b, 1, swap);
+    const auto frames = test_frames();
+    for (size_t k = 0; k < frames.size(); ++ k) {
+        put32(b, ts_sec + k, swap);
+        put32(b, nano ? 123456789 : 123456, swap);
+        put32(b, frames[k].size(), swap);
+        put32(b, frames[k].size(), swap);
+        put_bytes(b, frames[k]);
+    }
+    return b;
+}
+
+static void put_block(bytes_t & b, const uint32_t type, const bytes_t & body) {
+    const uint32_t len = 12 + ((body.size() + 3) & ~3ul);
+    put32(b, type);
+    put32(b, len);
+    put_bytes(b, body);
+    b.resize(b.size() + (len - 12 - body.size()), 0);
+    put32(b, len);
+}
+
+// Two interfaces, the default microsecond one and a nanosecond one
+static auto make_pcapng() -> bytes_t {
+    bytes_t b, shb, idb_us, idb_ns;
+    put32(shb, 0x1A2B3C4D);
+    put16(shb, 1);
+    put16(shb, 0);
+    put32(shb, 0xFFFFFFFF);
+    put32(shb, 0xFFFFFFFF);
+    put_block(b, 0x0A0D0D0A, shb);
+
+    put16(idb_us, 1);
+    put16(idb_us, 0);
+    put32(idb_us, 65535);
+    put_block(b, 1, idb_us);
+
+    put16(idb_ns, 1);
+    put16(idb_ns, 0);
+    put32(idb_ns, 65535);
+    put16(idb_ns, 9);
+    put16(idb_ns, 1);
+    put32(idb_ns, 9);
+    put32(idb_ns, 0);
+    put_block(b, 1, idb_ns);
+
+    const auto frames = test_frames();
+    for (size_t k = 0; k < frames.size(); ++ k) {
+        const bool nano = k % 2;
+        const uint64_t ticks = nano ? (ts_sec + k) * 1000000000ull + 123456789 : (ts_sec + k) * 1000000ull + 123456;
+        bytes_t epb;
+        put32(epb, nano);
+        put32(epb, ticks >> 32);
+        put32(epb, ticks & 0xFFFFFFFF);
+        put32(epb, frames[k].size());
+        put32(epb, frames[k].size());
+        put_bytes(epb, frames[k]);
+        put_block(b, 6, epb);
+    }
+    return b;
+}
+
+static void check_capture(const bytes_t & cap, const bool nano, const bool mixed) {
+    vector<pcap_decoder::frame_ref> frames;
+    CHECK(pcap_decoder::build_index(cap.data(), cap.size(), frames));
+    CHECK(frames.size() == 5);
+    if (frames.size() != 5) {
+        return;
+    }
+
+    packet_store store(frames.size());
+    addr6_buf_t addr6_buf;
+    for (size_t i = 0; i < frames.size(); ++ i) {
+        pcap_decoder::decode_frame(cap.data(), frames[i], store, i, addr6_buf);
+        const bool _nano = mixed ? i % 2 : nano;
+        CHECK_NEAR(frames[i].ts, ts_sec + i + (_nano ? 0.123456789 : 0.123456), 1e-15);
+        CHECK(store.ts[i] == (store.ip_ver[i] == PKT_IP_BAD ? 0 : frames[i].ts));
+    }
+
+    // IPv4 TCP SYN, the addresses keep the network byte order
+    const uint8_t addr_s[] = {10, 0, 0, 1}, addr_d[] = {10, 0, 0, 2};
+    CHECK(store.is_ipv4(0) && store.src_port[0] == 1234 && store.dst_port[0] == 80 && store.len[0] == 40);
+    CHECK(memcmp(&store.src_addr[0], addr_s, 4) == 0 && memcmp(&store.dst_addr[0], addr_d, 4) == 0);
+    CHECK(test_pkt_type_code(store.tp[0], pkt_type_t::IPv4) && test_pkt_type_code(store.tp[0], pkt_type_t::TCP_SYN));
+    CHECK(!test_pkt_type_code(store.tp[0], pkt_type_t::TCP_ACK));
+
+    // IPv4 UDP behind a VLAN tag
+    CHECK(store.is_ipv4(1) && store.src_port[1] == 53 && store.dst_port[1] == 5353 && store.len[1] == 28);
+    CHECK(test_pkt_type_code(store.tp[1], pkt_type_t::UDP));
+
+    // IPv6 TCP ACK, the addresses go to the worker-local buffer
+    CHECK(store.is_ipv6(2) && store.src_port[2] == 443 && store.dst_port[2] == 8443 && store.len[2] == 60);
+    CHECK(test_pkt_type_code(store.tp[2], pkt_type_t::IPv6) && test_pkt_type_code(store.tp[2], pkt_type_t::TCP_ACK));
+    CHECK(addr6_buf.size() == 1 && store.src_addr[2] == 0);
+    if (addr6_buf.size() == 1) {
+        const auto * s6 = reinterpret_cast<const uint8_t *>(&addr6_buf[0].first);
+        const auto * d6 = reinterpret_cast<const uint8_t *>(&addr6_buf[0].second);
+        CHECK(s6[0] == 0 && s6[15] == 15 && d6[0] == (0x80 | 16) && d6[15] == (0x80 | 31));
+    }
+
+    // ARP is out of scope, the slot stays as a bad record
+    CHECK(!store.is_ipv4(3) && !store.is_ipv6(3) && store.len[3] == 0);
+
+    CHECK(store.is_ipv4(4) && test_pkt_type_code(store.tp[4], pkt_type_t::ICMP));
+}
+
+
+int main() {
+    check_capture(make_pcap(false, false), false, false);
+    check_capture(make_pcap(true, false), false, false);
+    check_capture(make_pcap(false, true), true, false);
+    check_capture(make_pcap(true, true), true, false);
+    check_capture(make_pcapng(), false, true);
+
+    // A truncated last record is dropped, a foreign magic is refused
+    bytes_t cap = make_pcap(false, false);
+    cap.resize(cap.size() - 10);
+    vector<pcap_decoder::frame_ref> frames;
+    CHECK(pcap_decoder::build_index(cap.data(), cap.size(), frames) && frames.size() == 4);
+    frames.clear();
+    const bytes_t junk(64, 0x5A);
+    CHECK(!pcap_decoder::build_index(junk.data(), junk.size(), frames) && frames.empty());
+
+    return test_result();
+}
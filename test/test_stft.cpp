@@ -0,0 +1,95 @@
+#include "test_common.hpp"
+#include "../commune/stft_kernel.hpp"
+
+#include <random>
+
+using namespace Whisper;
+
+
+// Textbook STFT in long double: reflect padding, periodic Hann window, hop n_fft / 4,
+// onesided bins, log2(1 + |X|^2) per cell
+static auto naive_stft(const vector<double_t> & x, const size_t n_fft) -> vector<vector<double_t> > {
+    const long double two_pi = 2.0L * acosl(-1.0L);
+    const size_t pad = n_fft / 2, hop = n_fft / 4, num_bin = n_fft / 2 + 1;
+    const long len = x.size();
+    vector<long double> padded(x.size() + 2 * pad);
+    for (long j = 0; j < (long) padded.size(); ++ j) {
+        long s = j - (long) pad;
+        s = s < 0 ? -s : (s >= len ? 2 * (len - 1) - s : s);
+        padded[j] = x[s];
+    }
+    vector<vector<double_t> > rows;
+    for (size_t f = 0; f * hop + n_fft <= padded.size(); ++ f) {
+        vector<double_t> row(num_bin);
+        for (size_t k = 0; k < num_bin; ++ k) {
+            long double re = 0, im = 0;
+            for (size_t n = 0; n < n_fft; ++ n) {
+                const long double w = 0.5L - 0.5L * cosl(two_pi * n / n_fft);
+                re += padded[f * hop + n] * w * cosl(two_pi * k * n / n_fft);
+                im -= padded[f * hop + n] * w * sinl(two_pi * k * n / n_fft);
+            }
+            row[k] = log2l(1 + re * re + im * im);
+        }
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+static void check_size(const size_t n_fft, const bool single, const bool fixed) {
+    // Packet lengths between 40 and 1500, as the analyzer feeds the kernel
+    mt19937 rng(n_fft);
+    vector<double_t> x(n_fft * 5 + 3);
+    for (auto & v : x) {
+        v = 40 + rng() % 1461;
+    }
+
+    const auto p_kernel = stft_kernel::get(n_fft, single);
+    CHECK(p_kernel == stft_kernel::get(n_fft, single));
+    CHECK(p_kernel->is_single() == single && p_kernel->is_fixed_size() == fixed);
+
+    spectrogram spec;
+    vector<double_t> padded;
+    p_kernel->transform(x.data(), x.size(), spec, padded);
+    const auto ref = naive_stft(x, n_fft);
+    CHECK(spec.num_frame == ref.size() && spec.num_frame == p_kernel->get_num_frame(x.size()));
+    CHECK(spec.num_bin == n_fft / 2 + 1 && spec.single == single);
+    if (spec.num_frame != ref.size()) {
+        return;
+    }
+
+    // The cells reach about 40, the float ones carry the float rounding of the frame sums
+    const double_t tol = single ? 1e-4 : 1e-12;
+    double_t worst = 0;
+    for (size_t f = 0; f < spec.num_frame; ++ f) {
+        for (size_t k = 0; k < spec.num_bin; ++ k) {
+            const double_t cell = single ? spec.row32(f)[k] : spec.row(f)[k];
+            worst = max(worst, fabs(cell - ref[f][k]) / max(1.0, fabs(ref[f][k])));
+        }
+    }
+    CHECK(worst <= tol);
+
+    // Window means from the prefix sums against a direct mean
+    spec.build_prefix();
+    vector<double_t> mean(spec.num_bin);
+    spec.window_mean(1, spec.num_frame, mean.data());
+    for (size_t k = 0; k < spec.num_bin; ++ k) {
+        double_t sum = 0;
+        for (size_t f = 1; f < spec.num_frame; ++ f) {
+            sum += ref[f][k];
+        }
+        CHECK_NEAR(mean[k], sum / (spec.num_frame - 1), tol);
+    }
+}
+
+
+int main() {
+    for (const bool single : {false, true}) {
+        check_size(16, single, false);
+        check_size(20, single, false);
+        check_size(32, single, true);
+        check_size(50, single, true);
+        check_size(64, single, true);
+        check_size(128, single, true);
+    }
+    return test_result();
+}